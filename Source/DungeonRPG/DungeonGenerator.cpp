@@ -3,8 +3,20 @@
 
 #include "DungeonGenerator.h"
 
+#include "DungeonLayoutLibrary.h"
+#include "DungeonRoomShapeAsset.h"
+#include "Algo/BinarySearch.h"
+#include "Algo/Sort.h"
+#include "Async/ParallelFor.h"
+#include "Components/InstancedStaticMeshComponent.h"
+#include "Engine/BlueprintGeneratedClass.h"
+#include "Engine/SCS_Node.h"
+#include "Engine/SimpleConstructionScript.h"
+#include "Engine/StaticMesh.h"
 #include "Kismet/KismetMathLibrary.h"
+#include "ProfilingDebugging/CsvProfiler.h"
 
+CSV_DEFINE_CATEGORY(DungeonGenerator, true);
 
 // Sets default values
 ADungeonGenerator::ADungeonGenerator()
@@ -12,26 +24,130 @@ ADungeonGenerator::ADungeonGenerator()
  	// Set this actor to call Tick() every frame.  You can turn this off to improve performance if you don't need it.
 	PrimaryActorTick.bCanEverTick = true;
 
+	// Instanced floors and walls are attached to this
+	RootComponent = CreateDefaultSubobject<USceneComponent>(TEXT("Root"));
 }
 
 // Called when the game starts or when spawned
 void ADungeonGenerator::BeginPlay()
 {
 	Super::BeginPlay();
-	
+
+	// A dungeon spawned in the editor comes into play without its layout. Rebuild it now rather than on the first
+	// level change, so streaming doesn't hitch mid-game.
+	if (LevelStreamingRadius >= 0)
+	{
+		RestoreSpawnedLayout();
+	}
+}
+
+void ADungeonGenerator::PostLoad()
+{
+	Super::PostLoad();
+
+	if (FloorActors_DEPRECATED.IsEmpty() && WallActors_DEPRECATED.IsEmpty()) return;
+
+	// Old dungeons only had one level, so their actors all belong to level 0
+	if (LevelActors.IsEmpty())
+	{
+		LevelActors.SetNum(1);
+	}
+	FDungeonLevelActors& Actors = LevelActors[0];
+	Actors.bIsSpawned = true;
+	Actors.FloorActors.Append(FloorActors_DEPRECATED);
+
+	// Walls used to be kept in a plain array, so work out which tiles each one was between from where it stands.
+	// A wall sits halfway between its two tiles, so one of its coordinates is a whole tile and the other a half.
+	for (AActor* Wall : WallActors_DEPRECATED)
+	{
+		if (!IsValid(Wall) || FloorMeshWidth <= 0.f) { continue; }
+
+		const FVector Location = Wall->GetActorLocation();
+		const int DoubledX = FMath::RoundToInt(2.f * Location.X / FloorMeshWidth);
+		const int DoubledY = FMath::RoundToInt(2.f * Location.Y / FloorMeshWidth);
+		const FCoordPair Key = DoubledX % 2 == 0
+			? FCoordPair(FCoord(DoubledX / 2, (DoubledY - 1) / 2), FCoord(DoubledX / 2, (DoubledY + 1) / 2))
+			: FCoordPair(FCoord((DoubledX - 1) / 2, DoubledY / 2), FCoord((DoubledX + 1) / 2, DoubledY / 2));
+		if (!Actors.WallActors.Contains(Key))
+		{
+			Actors.WallActors.Add(Key, Wall);
+		}
+		else
+		{
+			// Only a wall moved by hand can land on another one. FloorActors has to line up with the rooms, so it is
+			// kept apart until the level is destroyed.
+			Actors.LegacyActors.Add(Wall);
+		}
+	}
+
+	FloorActors_DEPRECATED.Empty();
+	WallActors_DEPRECATED.Empty();
+}
+
+#if WITH_EDITOR
+void ADungeonGenerator::PreEditChange(FProperty* PropertyAboutToChange)
+{
+	Super::PreEditChange(PropertyAboutToChange);
+
+	PreEditLevelStreamingRadius = LevelStreamingRadius;
+}
+
+void ADungeonGenerator::PostEditChangeProperty(FPropertyChangedEvent& PropertyChangedEvent)
+{
+	Super::PostEditChangeProperty(PropertyChangedEvent);
+
+	const FName PropertyName = PropertyChangedEvent.GetPropertyName();
+	if (PropertyName == GET_MEMBER_NAME_CHECKED(ADungeonGenerator, NumOfRoomsToGenerate) ||
+		PropertyName == GET_MEMBER_NAME_CHECKED(ADungeonGenerator, FloorMeshWidth) ||
+		PropertyName == GET_MEMBER_NAME_CHECKED(ADungeonGenerator, LevelHeight))
+	{
+		// Only update a dungeon that already exists, changing the settings shouldn't generate one from nothing
+		if (CanUpdateLayout())
+		{
+			const FDateTime StartTime = FDateTime::UtcNow();
+			UpdateLayout();
+			const float TimeElapsedInMs = (FDateTime::UtcNow() - StartTime).GetTotalMilliseconds();
+			UE_LOG(LogTemp, Display, TEXT("Updated dungeon in %fms"), TimeElapsedInMs)
+		}
+	}
+	else if (PropertyName == GET_MEMBER_NAME_CHECKED(ADungeonGenerator, LevelStreamingRadius))
+	{
+		if (!StreamLevels())
+		{
+			UE_LOG(LogTemp, Error, TEXT("Couldn't stream in the levels for LevelStreamingRadius %d, changed back to %d."), LevelStreamingRadius, PreEditLevelStreamingRadius)
+			LevelStreamingRadius = PreEditLevelStreamingRadius;
+			GenerationReport = BuildGenerationReport(bSpawnInstancedMeshes);
+			GenerationReport.bWasAborted = true;
+		}
+	}
 }
+#endif
 
 void ADungeonGenerator::GenerateDungeon()
 {
 	UE_LOG(LogTemp, Warning, TEXT("ADungeonGenerator::GenerateDungeon()"))
 
-	// Clears any meshes that may have spawned from previous generations
-	ClearDungeon();
+	if (bRandomiseSeed)
+	{
+		Seed = FMath::Rand();
+	}
 
-	// Verify parameters are valid
-	
 	const FDateTime StartTime = FDateTime::UtcNow();
-	GenerateLayout(NumOfRoomsToGenerate);
+	if (bUseLayoutLibrary && SpawnBakedLayout())
+	{
+		// Nothing to generate, the baked layout went straight to spawning
+	}
+	else if (CanUpdateLayout())
+	{
+		// Same dungeon as last time, so only the rooms and meshes affected by changed settings need updating
+		UpdateLayout();
+	}
+	else
+	{
+		// Clears any meshes that may have spawned from previous generations
+		ClearDungeon();
+		GenerateLayout(NumOfRoomsToGenerate);
+	}
 	const float TimeElapsedInMs = (FDateTime::UtcNow() - StartTime).GetTotalMilliseconds();
 	UE_LOG(LogTemp, Display, TEXT("Total Startup in %fms"), TimeElapsedInMs)
 	
@@ -39,16 +155,127 @@ void ADungeonGenerator::GenerateDungeon()
 
 void ADungeonGenerator::ClearDungeon()
 {
-	while (!FloorActors.IsEmpty())
+	for (int Level = 0; Level < LevelActors.Num(); Level++)
 	{
-		AActor* Mesh = FloorActors.Pop();
-		Mesh->Destroy();
+		DestroyLevelMeshes(Level);
+	}
+	LevelActors.Empty();
+
+	Generation = FDungeonGeneration();
+	LevelCounts.Empty();
+	SpawnedLayoutLibrary = nullptr;
+	SpawnedBakedLayoutIndex = INDEX_NONE;
+	SpawnedNumRooms = 0;
+	bHasCachedLayout = false;
+}
+
+#if WITH_EDITOR
+void ADungeonGenerator::BakeLayoutLibrary()
+{
+	if (!LayoutLibrary)
+	{
+		UE_LOG(LogTemp, Error, TEXT("No LayoutLibrary to bake into. Exiting..."));
+		return;
 	}
-	while (!WallActors.IsEmpty())
+
+	TArray<int32> RoomCounts = BakeRoomCounts;
+	if (RoomCounts.IsEmpty())
 	{
-		AActor* Mesh = WallActors.Pop();
-		Mesh->Destroy();
+		RoomCounts.Add(NumOfRoomsToGenerate);
+	}
+
+	const uint32 SettingsHash = GetLayoutSettingsHash();
+	const FDateTime StartTime = FDateTime::UtcNow();
+	LayoutLibrary->Modify();
+	LayoutLibrary->Layouts.Reset();
+	for (const int32 NumRooms : RoomCounts)
+	{
+		for (int i = 0; i < BakeNumSeeds; i++)
+		{
+			FDungeonGeneration BakeGeneration;
+			if (!BuildGeneration(BakeFirstSeed + i, NumRooms, BakeGeneration)) { continue; }
+
+			FDungeonBakedLayout& BakedLayout = LayoutLibrary->Layouts.AddDefaulted_GetRef();
+			BakedLayout.Seed = BakeGeneration.Seed;
+			BakedLayout.NumRooms = NumRooms;
+			BakedLayout.SettingsHash = SettingsHash;
+			BakedLayout.Levels.SetNum(BakeGeneration.Levels.Num());
+			for (int Level = 0; Level < BakeGeneration.Levels.Num(); Level++)
+			{
+				BakeLevel(BakeGeneration, Level, BakedLayout.Levels[Level]);
+			}
+			for (const FDungeonStair& Stair : BakeGeneration.Stairs)
+			{
+				BakedLayout.Stairs.Add(Stair.LowerTile.ToIntVector());
+				BakedLayout.StairRooms.Add(FIntPoint(Stair.LowerRoomIndex, Stair.UpperRoomIndex));
+			}
+		}
 	}
+	LayoutLibrary->MarkPackageDirty();
+
+	const float TimeElapsedInMs = (FDateTime::UtcNow() - StartTime).GetTotalMilliseconds();
+	UE_LOG(LogTemp, Display, TEXT("Baked %d layouts into %s in %fms"), LayoutLibrary->Layouts.Num(), *LayoutLibrary->GetName(), TimeElapsedInMs)
+}
+#endif
+
+bool ADungeonGenerator::CanUpdateLayout() const
+{
+	return bHasCachedLayout &&
+		CachedSeed == Seed &&
+		CachedNumLevels == NumLevels &&
+		CachedPlacementWeights == PlacementWeights &&
+		CachedFloorActor == FloorActor &&
+		CachedWallActor == WallActor &&
+		CachedStairActor == StairActor &&
+		bCachedUseInstancedMeshes == bUseInstancedMeshes &&
+		CachedFloorMesh == FloorMesh &&
+		CachedWallMesh == WallMesh &&
+		CachedRoomShapes == RoomShapes &&
+		CachedMaxRoomVariantsInGeneration == MaxRoomVariantsInGeneration;
+}
+
+FRandomStream ADungeonGenerator::GetRoomRandomStream(const FDungeonLayout& RoomLayout, const int RoomIndex) const
+{
+	return FRandomStream(static_cast<int32>(HashCombine(HashCombine(GetTypeHash(RoomLayout.Seed), GetTypeHash(RoomLayout.Level)), GetTypeHash(RoomIndex))));
+}
+
+void ADungeonGenerator::SetActiveLevel(const int32 Level)
+{
+	const int32 PreviousActiveLevel = ActiveLevel;
+	ActiveLevel = FMath::Clamp(Level, 0, FMath::Max(LevelActors.Num()-1, 0));
+	if (!StreamLevels())
+	{
+		// The levels around the previous active level are still the ones streamed in
+		UE_LOG(LogTemp, Error, TEXT("Couldn't stream in the levels around level %d, staying on level %d."), ActiveLevel, PreviousActiveLevel)
+		ActiveLevel = PreviousActiveLevel;
+		GenerationReport = BuildGenerationReport(bSpawnInstancedMeshes);
+		GenerationReport.bWasAborted = true;
+	}
+}
+
+bool ADungeonGenerator::StreamLevels()
+{
+	if (LevelActors.IsEmpty()) return true;
+	if (!RestoreSpawnedLayout()) return false;
+
+	// Spawn costs only cover the streamed in levels, so check the new set of them fits before spawning any
+	const bool bWasInstanced = bSpawnInstancedMeshes;
+	if (!ApplyBudget()) return false;
+
+	for (int i = 0; i < LevelActors.Num(); i++)
+	{
+		const bool bShouldBeSpawned = ShouldLevelBeSpawned(i);
+		// Levels that stay streamed in are respawned if the budget switched the dungeon to instances
+		if (LevelActors[i].bIsSpawned && (!bShouldBeSpawned || bSpawnInstancedMeshes != bWasInstanced))
+		{
+			DestroyLevelMeshes(i);
+		}
+		if (bShouldBeSpawned && !LevelActors[i].bIsSpawned)
+		{
+			SpawnLevelMeshes(i);
+		}
+	}
+	return true;
 }
 
 // Called every frame
@@ -56,6 +283,8 @@ void ADungeonGenerator::Tick(float DeltaTime)
 {
 	Super::Tick(DeltaTime);
 
+	// CSV stats only cover the frame they are set in, so they are set every frame. This does nothing unless a capture is running.
+	RecordCsvStats();
 }
 
 
@@ -64,18 +293,40 @@ FCoord::FCoord()
 {
 	X = 0;
 	Y = 0;
+	Z = 0;
 }
 	
 FCoord::FCoord(int InX, int InY)
 {
 	X = InX;
 	Y = InY;
+	Z = 0;
+}
+
+FCoord::FCoord(int InX, int InY, int InZ)
+{
+	X = InX;
+	Y = InY;
+	Z = InZ;
+}
+
+FCoord::FCoord(const FIntVector& Vector)
+{
+	X = Vector.X;
+	Y = Vector.Y;
+	Z = Vector.Z;
+}
+
+FIntVector FCoord::ToIntVector() const
+{
+	return FIntVector(X, Y, Z);
 }
 
 bool FCoord::operator== (const FCoord& Other) const
 {
 	return (X == Other.X &&
-			Y == Other.Y);
+			Y == Other.Y &&
+			Z == Other.Z);
 }
 
 FCoord FCoord::operator+(FCoord const& obj) const
@@ -83,6 +334,7 @@ FCoord FCoord::operator+(FCoord const& obj) const
 	FCoord res;
 	res.X = X + obj.X;
 	res.Y = Y + obj.Y;
+	res.Z = Z + obj.Z;
 	return res;
 }
 
@@ -93,27 +345,27 @@ bool FCoord::operator< (FCoord const& C2) const
 
 int FCoord::GetManhattanDistanceBetweenCoords(FCoord A, FCoord B)
 {
-	return abs(A.X - B.X) + abs(A.Y - B.Y);
+	return abs(A.X - B.X) + abs(A.Y - B.Y) + abs(A.Z - B.Z);
 }
 
 float FCoord::GetEuclideanDistanceBetweenCoords(FCoord A, FCoord B)
 {
-	return UKismetMathLibrary::Sqrt(((A.X - B.X)*(A.X - B.X)) + ((A.Y - B.Y)*(A.Y - B.Y)));
+	return UKismetMathLibrary::Sqrt(((A.X - B.X)*(A.X - B.X)) + ((A.Y - B.Y)*(A.Y - B.Y)) + ((A.Z - B.Z)*(A.Z - B.Z)));
 }
 
-TArray<FCoord> FCoord::Get4AdjacentTiles(FCoord Centre)
+TStaticArray<FCoord, 4> FCoord::Get4AdjacentTiles(FCoord Centre)
 {
-	TArray<FCoord> AdjacentCoords = {
-		Centre+FCoord(0,-1),
-		Centre+FCoord(1,0),
-		Centre+FCoord(0,1),
-		Centre+FCoord(-1,0)};
+	TStaticArray<FCoord, 4> AdjacentCoords;
+	AdjacentCoords[0] = Centre+FCoord(0,-1);
+	AdjacentCoords[1] = Centre+FCoord(1,0);
+	AdjacentCoords[2] = Centre+FCoord(0,1);
+	AdjacentCoords[3] = Centre+FCoord(-1,0);
 	return AdjacentCoords;
 }
 
 FCoord FCoord::Inverse() const
 {
-	return FCoord(-this->X, -this->Y);
+	return FCoord(-this->X, -this->Y, -this->Z);
 }
 
 
@@ -173,425 +425,1462 @@ FDungeonRoom::FDungeonRoom(const FCoord InGlobalCentre, const TArray<FCoord>& In
 	PossibleRoomsIndex = InPossibleRoomsIndex;
 }
 
-int FDungeonRoom::MaxManhattanDistanceBetweenRooms(TArray<FCoord> A, TArray<FCoord> B)
+
+bool FDungeonRoomVariant::Build(const TArray<FCoord>& InTiles, FDungeonRoomVariant& OutVariant)
 {
-	int MaxA = 0;
-	for (const FCoord C : A)
-	{
-		MaxA = FMath::Max3(MaxA,abs(C.X),abs(C.Y));
-	}
-	int MaxB = 0;
-	for (const FCoord C : B)
+	if (InTiles.IsEmpty()) return false;
+
+	OutVariant = FDungeonRoomVariant();
+	OutVariant.Tiles = InTiles;
+
+	OutVariant.BoundsMin = FCoord(MAX_int32, MAX_int32);
+	OutVariant.BoundsMax = FCoord(MIN_int32, MIN_int32);
+	for (const FCoord Tile : InTiles)
 	{
-		MaxB = FMath::Max3(MaxB,abs(C.X),abs(C.Y));
+		OutVariant.BoundsMin = FCoord(FMath::Min(OutVariant.BoundsMin.X, Tile.X), FMath::Min(OutVariant.BoundsMin.Y, Tile.Y));
+		OutVariant.BoundsMax = FCoord(FMath::Max(OutVariant.BoundsMax.X, Tile.X), FMath::Max(OutVariant.BoundsMax.Y, Tile.Y));
 	}
-	return 2 * (MaxA + MaxB + 1);
-}
+	if (OutVariant.BoundsMax.X - OutVariant.BoundsMin.X + 1 > MaxWidth) return false;
 
-bool FDungeonRoom::DoRoomsOverlap(FDungeonRoom A, FDungeonRoom B)
-{		
-	TSet<FCoord> GlobalCoords;
-	for (FCoord Coord : A.LocalCoordOffsets)
+	OutVariant.RowMasks.SetNumZeroed(OutVariant.BoundsMax.Y - OutVariant.BoundsMin.Y + 1);
+	for (const FCoord Tile : InTiles)
 	{
-		GlobalCoords.Add(Coord+A.GlobalCentre);
+		OutVariant.RowMasks[Tile.Y - OutVariant.BoundsMin.Y] |= uint64(1) << (Tile.X - OutVariant.BoundsMin.X);
 	}
-	bool WasInSet = false;
-	for (FCoord Coord : B.LocalCoordOffsets)
+
+	// For every tile in the room, find all adjacent tiles that are NOT in the room.
+	for (const FCoord Tile : InTiles)
 	{
-		GlobalCoords.Add(Coord+B.GlobalCentre, &WasInSet);
-		if (WasInSet) return true;
+		for (const FCoord AdjacentTile : FCoord::Get4AdjacentTiles(Tile))
+		{
+			if (OutVariant.ContainsTile(AdjacentTile)) { continue; }
+
+			FDungeonRoomEdge Edge;
+			Edge.Inside = Tile;
+			Edge.Outside = AdjacentTile;
+			OutVariant.PerimeterEdges.Add(Edge);
+		}
 	}
-	return false;
+	return true;
+}
+
+SIZE_T FDungeonRoomVariant::GetAllocatedSize() const
+{
+	return Tiles.GetAllocatedSize() + RowMasks.GetAllocatedSize() + PerimeterEdges.GetAllocatedSize();
 }
 
-bool FDungeonRoom::AreRoomsTouching(const FDungeonRoom& A, const FDungeonRoom& B)
+bool FDungeonRoomVariant::ContainsTile(const FCoord LocalTile) const
 {
-	if (DoRoomsOverlap(A, B))
+	if (LocalTile.X < BoundsMin.X || LocalTile.X > BoundsMax.X || LocalTile.Y < BoundsMin.Y || LocalTile.Y > BoundsMax.Y)
 	{
 		return false;
 	}
-	// Make sure that if one of the rooms expands by 1, they do overlap
-	// Expand room A by 1
-	const TSet<FCoord> ReferenceLocalCoordsA = TSet(A.LocalCoordOffsets); 
-	TSet<FCoord> LocalCoordsA;
-	// For every coord, add all adjacent coords to set
-	for (const FCoord CurrentCoord : A.LocalCoordOffsets)
+	return ((RowMasks[LocalTile.Y - BoundsMin.Y] >> (LocalTile.X - BoundsMin.X)) & 1) != 0;
+}
+
+
+void FDungeonOccupancyGrid::Add(const FCoord Tile)
+{
+	GrowToInclude(Tile);
+	const int Column = Tile.X - MinWord * 64;
+	Words[(Tile.Y - MinY) * WordsPerRow + Column / 64] |= uint64(1) << (Column % 64);
+}
+
+void FDungeonOccupancyGrid::Remove(const FCoord Tile)
+{
+	if (!Contains(Tile)) return;
+	const int Column = Tile.X - MinWord * 64;
+	Words[(Tile.Y - MinY) * WordsPerRow + Column / 64] &= ~(uint64(1) << (Column % 64));
+}
+
+bool FDungeonOccupancyGrid::Contains(const FCoord Tile) const
+{
+	return (GetRowBits(Tile.Y, Tile.X) & 1) != 0;
+}
+
+bool FDungeonOccupancyGrid::Overlaps(const FDungeonRoomVariant& Variant, const FCoord Centre) const
+{
+	const int RowStartX = Centre.X + Variant.BoundsMin.X;
+	for (int Row = 0; Row < Variant.RowMasks.Num(); Row++)
 	{
-		for (FCoord AdjacentCoord : FCoord::Get4AdjacentTiles(CurrentCoord))
+		if (GetRowBits(Centre.Y + Variant.BoundsMin.Y + Row, RowStartX) & Variant.RowMasks[Row])
 		{
-			if (ReferenceLocalCoordsA.Contains(AdjacentCoord))
-			{
-				continue;
-			}
-			LocalCoordsA.Add(AdjacentCoord);
-		}	
+			return true;
+		}
 	}
-		
-	FDungeonRoom ExpandedA = A;
-	ExpandedA.LocalCoordOffsets = LocalCoordsA.Array();
-	return DoRoomsOverlap(ExpandedA, B);
+	return false;
 }
 
+uint64 FDungeonOccupancyGrid::GetRowBits(const int Y, const int X) const
+{
+	const int Row = Y - MinY;
+	if (Row < 0 || Row >= NumRows) return 0;
+
+	// Tiles from X onwards straddle at most two words
+	const int Column = X - MinWord * 64;
+	const int Word = Column >= 0 ? Column / 64 : (Column - 63) / 64;
+	const int Bit = Column - Word * 64;
+	const uint64 Low = GetWord(Row, Word) >> Bit;
+	const uint64 High = Bit ? GetWord(Row, Word + 1) << (64 - Bit) : 0;
+	return Low | High;
+}
 
+uint64 FDungeonOccupancyGrid::GetWord(const int Row, const int Word) const
+{
+	if (Word < 0 || Word >= WordsPerRow) return 0;
+	return Words[Row * WordsPerRow + Word];
+}
 
-void ADungeonGenerator::GenerateLayout(const int NumRooms)
+void FDungeonOccupancyGrid::GrowToInclude(const FCoord Tile)
 {
-	// First check that num of rooms is valid
-	if ((NumRooms <= 0) || (NumRooms > 100)) // TODO make max more if it is efficient
+	const int TileWord = Tile.X >= 0 ? Tile.X / 64 : (Tile.X - 63) / 64;
+	const int Row = Tile.Y - MinY;
+	const int Word = TileWord - MinWord;
+	if (Row >= 0 && Row < NumRows && Word >= 0 && Word < WordsPerRow) return;
+
+	// Grow by a margin on every side, so a layout that keeps expanding only needs to be copied now and then
+	constexpr int RowMargin = 16;
+	constexpr int WordMargin = 1;
+	const bool bIsEmpty = NumRows == 0;
+	const int NewMinY = (bIsEmpty ? Tile.Y : FMath::Min(MinY, Tile.Y)) - RowMargin;
+	const int NewMaxY = (bIsEmpty ? Tile.Y : FMath::Max(MinY + NumRows - 1, Tile.Y)) + RowMargin;
+	const int NewMinWord = (bIsEmpty ? TileWord : FMath::Min(MinWord, TileWord)) - WordMargin;
+	const int NewMaxWord = (bIsEmpty ? TileWord : FMath::Max(MinWord + WordsPerRow - 1, TileWord)) + WordMargin;
+
+	const int NewNumRows = NewMaxY - NewMinY + 1;
+	const int NewWordsPerRow = NewMaxWord - NewMinWord + 1;
+	TArray<uint64> NewWords;
+	NewWords.SetNumZeroed(NewNumRows * NewWordsPerRow);
+	for (int OldRow = 0; OldRow < NumRows; OldRow++)
 	{
-		UE_LOG(LogTemp, Error, TEXT("NumRooms out of bounds (%d). Should be between 0 and 20. Exiting..."), NumRooms);
-		return;
+		const int NewRow = OldRow + MinY - NewMinY;
+		FMemory::Memcpy(&NewWords[NewRow * NewWordsPerRow + MinWord - NewMinWord], &Words[OldRow * WordsPerRow], WordsPerRow * sizeof(uint64));
 	}
 
-	// Populate PotentialRooms with some layouts (just squares and rectangles for now)
-	TArray<TArray<FCoord>> PossibleRooms = InitPossibleRooms();
+	Words = MoveTemp(NewWords);
+	MinY = NewMinY;
+	MinWord = NewMinWord;
+	NumRows = NewNumRows;
+	WordsPerRow = NewWordsPerRow;
+}
 
-	// Calculate every combination of two rooms.
-	const FDateTime StartTime = FDateTime::UtcNow();
-	const TArray<TArray<TArray<FCoord>>> RoomComboOffsets = GenerateRoomComboOffsets(PossibleRooms);
-	const float TimeElapsedInMs = (FDateTime::UtcNow() - StartTime).GetTotalMilliseconds();
-	UE_LOG(LogTemp, Display, TEXT("Generated Room Offsets in %fms"), TimeElapsedInMs)
-	
-	TArray<FDungeonRoom> RoomLayout = {};
-	TSet<FCoord> RoomLayoutUsedCoords;
-	int HardCodedRoom1Index = 0;
-	RoomLayout.Add({FCoord(0,0), PossibleRooms[HardCodedRoom1Index], HardCodedRoom1Index}); // Same as recursive case but allows for hard coding starter room or something
-	for (FCoord Coord : PossibleRooms[HardCodedRoom1Index])
+
+int FDungeonLayout::AddRoom(const FCoord GlobalCentre, const int PossibleRoomsIndex)
+{
+	checkSlow(GlobalCentre.Z == Level);
+	const FDungeonRoomVariant& Variant = PossibleRooms[PossibleRoomsIndex];
+	const int RoomIndex = Rooms.Add(FDungeonRoom(GlobalCentre, Variant.Tiles, PossibleRoomsIndex));
+
+	for (const FCoord LocalCoord : Variant.Tiles)
 	{
-		RoomLayoutUsedCoords.Add(Coord);
+		const FCoord Tile = LocalCoord + GlobalCentre;
+		TileOwners.Add(Tile, RoomIndex);
+		Occupancy.Add(Tile);
 	}
-	
-	// Recursively place rest down
-	for (int i = 2; i <= NumRooms; i++)
+	return RoomIndex;
+}
+
+SIZE_T FDungeonLayout::GetAllocatedSize() const
+{
+	SIZE_T Size = Rooms.GetAllocatedSize() + TileOwners.GetAllocatedSize() + Occupancy.GetAllocatedSize();
+	for (const FDungeonRoom& Room : Rooms)
 	{
-		AddSingleRoomToLayout(RoomComboOffsets, PossibleRooms, RoomLayout, RoomLayoutUsedCoords);
+		Size += Room.LocalCoordOffsets.GetAllocatedSize();
 	}
-
-	SpawnMeshes(RoomLayout);
+	return Size;
 }
 
-TArray<TArray<FCoord>> ADungeonGenerator::InitPossibleRooms() const
+SIZE_T FDungeonGeneration::GetAllocatedSize() const
 {
-	// Init
-	TArray<TArray<FCoord>> AlLRooms;;
-	
-	//Iterate over every rectangle between 3 and 6 tiles dimension
-	 constexpr int MinSize = 2;
-	 constexpr int MaxSize = 3;
-	 for (int Width = MinSize; Width <= MaxSize; Width++)
-	 {
-	 	for (int Height = MinSize; Height <= MaxSize; Height++)
-	 	{
-	 		int W_Pos, W_Neg, H_Pos, H_Neg;
-	 		if (Width % 2 == 0)
-	 		{
-	 			W_Pos = Width/2;
-	 			W_Neg = -Width/2 + 1;
-	 		} else
-	 		{
-	 			W_Pos = Width/2;
-	 			W_Neg = -Width/2;
-	 		}
-	 		if (Height % 2 == 0)
-	 		{
-	 			H_Pos = Height/2 + 1;
-	 			H_Neg = -Height/2;
-	 		} else
-	 		{
-	 			H_Pos = Height/2;
-	 			H_Neg = -Height/2;
-	 		}
-	
-	 		TArray<FCoord> RoomOffsetLayout;
-	 		for (int W = W_Neg; W <= W_Pos; W++)
-	 		{
-	 			for (int H = H_Neg; H <= H_Pos; H++)
-	 			{
-	 				RoomOffsetLayout.Add(FCoord(W,H));
-	 			}
-	 		}
-	 		AlLRooms.Add(RoomOffsetLayout);
-	 		
-	 	}
-	 }
-
+	SIZE_T Size = RoomVariants.GetAllocatedSize() + Levels.GetAllocatedSize() + Stairs.GetAllocatedSize();
+	for (const FDungeonRoomVariant& Variant : RoomVariants)
+	{
+		Size += Variant.GetAllocatedSize();
+	}
+	for (const FDungeonLayout& RoomLayout : Levels)
+	{
+		Size += RoomLayout.GetAllocatedSize();
+	}
+	return Size;
+}
 
-	UE_LOG(LogTemp, Warning, TEXT("Total generated possible rooms: %d"), AlLRooms.Num());
+bool FDungeonBudget::IsExceededBy(const FDungeonGenerationReport& Report, FString& OutReason) const
+{
+	if (MaxActors > 0 && Report.NumActors > MaxActors)
+	{
+		OutReason = FString::Printf(TEXT("%d actors (limit %d)"), Report.NumActors, MaxActors);
+		return true;
+	}
+	if (MaxInstances > 0 && Report.NumInstances > MaxInstances)
+	{
+		OutReason = FString::Printf(TEXT("%d instances (limit %d)"), Report.NumInstances, MaxInstances);
+		return true;
+	}
+	if (MaxDrawCalls > 0 && Report.EstimatedDrawCalls > MaxDrawCalls)
+	{
+		OutReason = FString::Printf(TEXT("~%d draw calls (limit %d)"), Report.EstimatedDrawCalls, MaxDrawCalls);
+		return true;
+	}
+	if (MaxCollisionBodies > 0 && Report.EstimatedCollisionBodies > MaxCollisionBodies)
+	{
+		OutReason = FString::Printf(TEXT("~%d collision bodies (limit %d)"), Report.EstimatedCollisionBodies, MaxCollisionBodies);
+		return true;
+	}
+	if (MaxLayoutKilobytes > 0 && Report.LayoutBytes > static_cast<int64>(MaxLayoutKilobytes) * 1024)
+	{
+		OutReason = FString::Printf(TEXT("%lldKB of layout (limit %dKB)"), Report.LayoutBytes / 1024, MaxLayoutKilobytes);
+		return true;
+	}
+	return false;
+}
 
-	AlLRooms.Sort([this](const TArray<FCoord>& Item1, const TArray<FCoord>& Item2) {
-		return FMath::FRand() < 0.5f;
-	});
+EDungeonBudgetResult FDungeonBudget::Evaluate(const FDungeonGenerationReport& Report, const FDungeonGenerationReport* InstancedReport, FString& OutReason) const
+{
+	if (!IsExceededBy(Report, OutReason)) return EDungeonBudgetResult::WithinBudget;
 
-	TArray<TArray<FCoord>> PossibleRooms = {};
+	FString InstancedReason;
+	if (InstancedReport && OverBudgetAction == EDungeonBudgetAction::UseInstancedMeshes && !IsExceededBy(*InstancedReport, InstancedReason))
+	{
+		return EDungeonBudgetResult::UseInstancedMeshes;
+	}
+	return EDungeonBudgetResult::Abort;
+}
 
-	// Initialise max possible rooms, and reduces if not enough rooms in AllRooms
-	int MaxRoomsInGen = 12;
-	MaxRoomsInGen = FMath::Min(MaxRoomsInGen, AlLRooms.Num());
+void FDungeonLayout::RemoveLastRoom()
+{
+	const FDungeonRoom Room = Rooms.Pop();
+	const FDungeonRoomVariant& Variant = PossibleRooms[Room.PossibleRoomsIndex];
 
-	// Adds a random selection of 10 rooms into generation
-	for (int i = 0; i < MaxRoomsInGen; i++)
+	for (const FCoord LocalCoord : Variant.Tiles)
 	{
-		PossibleRooms.Add(AlLRooms[i]);
+		const FCoord Tile = LocalCoord + Room.GlobalCentre;
+		TileOwners.Remove(Tile);
+		Occupancy.Remove(Tile);
 	}
-	UE_LOG(LogTemp, Warning, TEXT("Total sampled possible rooms for actual generation: %d"), PossibleRooms.Num());
-	return PossibleRooms;
 }
 
-// Finds every offset to play Room B next to Room A
-TArray<FCoord> ADungeonGenerator::GenerateOffsetsForRooms(const TArray<FCoord>& RoomA, const TArray<FCoord>& RoomB)
-{	
-	TArray<FCoord> OutArray;
 
-	const int MaxBFSRange = FDungeonRoom::MaxManhattanDistanceBetweenRooms(RoomA, RoomB);
 
-	const FDungeonRoom RoomADungeonRoom = FDungeonRoom(FCoord(), RoomA);
-	FDungeonRoom RoomBDungeonRoom = FDungeonRoom(FCoord(), RoomB);
+void ADungeonGenerator::GenerateLayout(const int NumRooms)
+{
+	if (!BuildGeneration(Seed, NumRooms, Generation))
+	{
+		return;
+	}
 
-	TSet<FCoord> VisitedCoords;
-	TQueue<FCoord> SearchQueue;
-	SearchQueue.Enqueue(FCoord(0,0));
-	VisitedCoords.Add(FCoord(0,0));
+	SpawnedSeed = Seed;
+	SpawnedNumRooms = NumRooms;
+	SpawnedSettingsHash = GetLayoutSettingsHash();
+
+	// Remember what this layout was generated with, so it can be updated in place later
+	bHasCachedLayout = true;
+	CachedSeed = Seed;
+	CachedNumLevels = NumLevels;
+	CachedFloorMeshWidth = FloorMeshWidth;
+	CachedLevelHeight = LevelHeight;
+	CachedPlacementWeights = PlacementWeights;
+	CachedFloorActor = FloorActor;
+	CachedWallActor = WallActor;
+	CachedStairActor = StairActor;
+	bCachedUseInstancedMeshes = bUseInstancedMeshes;
+	CachedFloorMesh = FloorMesh;
+	CachedWallMesh = WallMesh;
+	CachedRoomShapes = RoomShapes;
+	CachedMaxRoomVariantsInGeneration = MaxRoomVariantsInGeneration;
+
+	LevelActors.SetNum(NumLevels);
+	UpdateLevelCounts();
+	ActiveLevel = FMath::Clamp(ActiveLevel, 0, NumLevels-1);
+	bSpawnInstancedMeshes = bUseInstancedMeshes;
+	const bool bIsWithinBudget = ApplyBudget();
+	LogGenerationReport();
+	if (!bIsWithinBudget)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Nothing was spawned."))
+		ClearDungeon();
+		return;
+	}
+	SpawnMeshes();
+}
 
-	const TSet<FCoord> RoomACoords = TSet(RoomA);
-	int CurrentRange = 0;
-	while (CurrentRange <= MaxBFSRange)
+bool ADungeonGenerator::BuildGeneration(const int32 GenerationSeed, const int NumRooms, FDungeonGeneration& OutGeneration) const
+{
+	// First check that num of rooms is valid
+	if ((NumRooms <= 0) || (NumRooms > 100)) // TODO make max more if it is efficient
+	{
+		UE_LOG(LogTemp, Error, TEXT("NumRooms out of bounds (%d). Should be between 1 and 100. Exiting..."), NumRooms);
+		return false;
+	}
+	if (NumLevels <= 0)
 	{
-		// Take top item from queue
-		FCoord CurrentCoord;
-		SearchQueue.Dequeue(CurrentCoord);
+		UE_LOG(LogTemp, Error, TEXT("NumLevels out of bounds (%d). Should be at least 1. Exiting..."), NumLevels);
+		return false;
+	}
 
-		// If current coord not in RoomA
-		if (!RoomACoords.Contains(CurrentCoord))
-		{
-			// Process it
-			CurrentRange = CurrentCoord.X + CurrentCoord.Y;
-			RoomBDungeonRoom.GlobalCentre = CurrentCoord;
+	// Every scratch container allocated during this generation lives on this thread's memory stack, and is released in
+	// one go when this mark goes out of scope
+	FMemMark GenerationMark(FMemStack::Get());
 
-			if (FDungeonRoom::AreRoomsTouching(RoomADungeonRoom, RoomBDungeonRoom))
-			{
-				OutArray.Add(CurrentCoord);
-			}
-		}
+	// Populate PotentialRooms with the room variants for this generation, shared by every level
+	OutGeneration = FDungeonGeneration();
+	OutGeneration.Seed = GenerationSeed;
+	FRandomStream PossibleRoomsStream(GenerationSeed);
+	OutGeneration.RoomVariants = InitPossibleRooms(PossibleRoomsStream);
+	if (OutGeneration.RoomVariants.IsEmpty())
+	{
+		UE_LOG(LogTemp, Error, TEXT("No valid room shapes to generate a dungeon from. Exiting..."));
+		return false;
+	}
 
-		// Add all neighbors to queue
-		for (FCoord AdjacentCoord : FCoord::Get4AdjacentTiles(CurrentCoord))
-		{
-			if (!VisitedCoords.Contains(AdjacentCoord))
-			{
-				VisitedCoords.Add(AdjacentCoord);
-				SearchQueue.Enqueue(AdjacentCoord);
-			}
-		}		
+	// Every level starts with the same room at the origin, which the stairs go through
+	int HardCodedRoom1Index = 0;
+	OutGeneration.Levels.SetNum(NumLevels);
+	for (int Level = 0; Level < NumLevels; Level++)
+	{
+		FDungeonLayout& RoomLayout = OutGeneration.Levels[Level];
+		RoomLayout.PossibleRooms = OutGeneration.RoomVariants;
+		RoomLayout.Seed = GenerationSeed;
+		RoomLayout.Level = Level;
+		RoomLayout.AddRoom(FCoord(0,0,Level), HardCodedRoom1Index); // Same as recursive case but allows for hard coding starter room or something
 	}
-	return OutArray;
+	InitStairs(OutGeneration);
+
+	// With the stairs fixed, each level is independent of the others
+	ParallelFor(NumLevels, [this, &OutGeneration, NumRooms](const int32 Level)
+	{
+		FMemMark LevelMark(FMemStack::Get());
+		FillLayout(OutGeneration.Levels[Level], NumRooms);
+	});
+	return true;
 }
 
-TArray<TArray<TArray<FCoord>>> ADungeonGenerator::GenerateRoomComboOffsets(TArray<TArray<FCoord>> PossibleRooms)
+bool ADungeonGenerator::SpawnBakedLayout()
 {
-	TArray<TArray<TArray<FCoord>>> RoomComboOffsets = {};
+	if (!LayoutLibrary) return false;
 
-	for (int i = 0; i < PossibleRooms.Num(); i++)
+	FRandomStream LayoutStream(Seed);
+	const int LayoutIndex = LayoutLibrary->PickLayout(NumOfRoomsToGenerate, NumLevels, GetLayoutSettingsHash(), Seed, LayoutStream);
+	if (LayoutIndex == INDEX_NONE)
 	{
-		TArray<TArray<FCoord>> SecondRoomConnections;
-		SecondRoomConnections.Init(TArray<FCoord>(), PossibleRooms.Num());
-		RoomComboOffsets.Add(SecondRoomConnections);
+		UE_LOG(LogTemp, Warning, TEXT("%s has no layout with %d levels of %d rooms baked with the current settings, generating one instead."), *LayoutLibrary->GetName(), NumLevels, NumOfRoomsToGenerate)
+		return false;
 	}
 
-	
-	
-	// Iterates over every room, and adds coord offsets from one room to the other
-	for (int i = 0; i < PossibleRooms.Num(); i++)
+	ClearDungeon();
+	SpawnedLayoutLibrary = LayoutLibrary;
+	SpawnedBakedLayoutIndex = LayoutIndex;
+
+	const FDungeonBakedLayout& BakedLayout = LayoutLibrary->Layouts[LayoutIndex];
+	SpawnedSeed = BakedLayout.Seed;
+	SpawnedNumRooms = BakedLayout.NumRooms;
+	SpawnedSettingsHash = BakedLayout.SettingsHash;
+	InitBakedStairs(BakedLayout);
+
+	LevelActors.SetNum(BakedLayout.Levels.Num());
+	UpdateLevelCounts();
+	ActiveLevel = FMath::Clamp(ActiveLevel, 0, FMath::Max(LevelActors.Num()-1, 0));
+	bSpawnInstancedMeshes = bUseInstancedMeshes;
+	const bool bIsWithinBudget = ApplyBudget();
+	LogGenerationReport();
+	if (!bIsWithinBudget)
 	{
-		for (int j = i; j < PossibleRooms.Num(); j++)
-		{
-			TArray<FCoord> ItoJOffsets = GenerateOffsetsForRooms(PossibleRooms[i], PossibleRooms[j]);
-			RoomComboOffsets[i][j] = ItoJOffsets;
+		UE_LOG(LogTemp, Warning, TEXT("Baked layout %d is over budget, generating one instead."), LayoutIndex)
+		ClearDungeon();
+		return false;
+	}
+	SpawnMeshes();
 
-			// If the Room is for itself, do reverse
-			if (i == j)
-			{
-				RoomComboOffsets[j][i] = ItoJOffsets;
-				continue;
-			}
+	UE_LOG(LogTemp, Display, TEXT("Spawned baked layout %d (seed %d) from %s"), LayoutIndex, BakedLayout.Seed, *LayoutLibrary->GetName())
+	return true;
+}
 
-			// Add inverse coords for inverse rooms
-			TArray<FCoord> JtoIOffsets;
-			for (FCoord Offset : ItoJOffsets)
+uint32 ADungeonGenerator::GetLayoutSettingsHash() const
+{
+	// The hash is saved with baked layouts, so only stable hashes are used: names rather than pointers, and HashCombine
+	// rather than HashCombineFast, which may change between engine versions. The class is included as it can override
+	// ScoreCandidates.
+	uint32 Hash = FCrc::StrCrc32(*GetClass()->GetPathName());
+	Hash = HashCombine(Hash, GetTypeHash(MaxRoomVariantsInGeneration));
+	Hash = HashCombine(Hash, GetTypeHash(PlacementWeights.DistanceToOrigin));
+	Hash = HashCombine(Hash, GetTypeHash(PlacementWeights.TouchingRooms));
+	Hash = HashCombine(Hash, GetTypeHash(PlacementWeights.BoundsGrowth));
+	Hash = HashCombine(Hash, GetTypeHash(PlacementWeights.Sharpness));
+
+	// The shapes' tiles rather than the assets, so editing a shape also invalidates layouts baked with it
+	for (const UDungeonRoomShapeAsset* RoomShape : RoomShapes)
+	{
+		Hash = HashCombine(Hash, GetTypeHash(RoomShape ? RoomShape->Variants.Num() : -1));
+		if (!RoomShape) { continue; }
+		for (const FDungeonRoomVariant& Variant : RoomShape->Variants)
+		{
+			for (const FCoord Tile : Variant.Tiles)
 			{
-				JtoIOffsets.Add(Offset.Inverse());
+				Hash = HashCombine(Hash, HashCombine(GetTypeHash(Tile.X), GetTypeHash(Tile.Y)));
 			}
-			RoomComboOffsets[j][i] = JtoIOffsets;
 		}
 	}
-	return RoomComboOffsets;
-	
+	return Hash;
 }
 
-void ADungeonGenerator::AddSingleRoomToLayout(TArray<TArray<TArray<FCoord>>> RoomComboOffsets, TArray<TArray<FCoord>> PossibleRooms, TArray<FDungeonRoom> &RoomLayout, TSet<FCoord> &RoomLayoutUsedCoords) const
+const FDungeonBakedLayout* ADungeonGenerator::GetSpawnedBakedLayout() const
 {
-	// Take a new random room layout (will be RoomB, placing room)
-	const int NewRoomIndex = FMath::RandRange(0,PossibleRooms.Num()-1);
-	TArray<FCoord> NewRoomLocalCoords = PossibleRooms[NewRoomIndex];
-	//UE_LOG(LogTemp, Warning, TEXT("Selected Room %d to be placed."), NewRoomIndex)
-	
+	if (!SpawnedLayoutLibrary || !SpawnedLayoutLibrary->Layouts.IsValidIndex(SpawnedBakedLayoutIndex)) return nullptr;
+	return &SpawnedLayoutLibrary->Layouts[SpawnedBakedLayoutIndex];
+}
 
-	// Find every existing room and their PossibleRooms index
-	// Find max manhattan distance across all placed rooms, and the random room layout
-	TSet<FCoord> PlaceableLocations;
-	for (FDungeonRoom Room : RoomLayout)
+void ADungeonGenerator::InitBakedStairs(const FDungeonBakedLayout& BakedLayout)
+{
+	// Only the stairs are needed from the generation, for the openings above them
+	Generation = FDungeonGeneration();
+	Generation.Seed = BakedLayout.Seed;
+	for (int i = 0; i < BakedLayout.Stairs.Num(); i++)
 	{
-		// Find all placeable points -> filter out direct centre overlaps
-		for (FCoord PossibleLocationOffset : RoomComboOffsets[Room.PossibleRoomsIndex][NewRoomIndex])
+		FDungeonStair Stair;
+		Stair.LowerTile = FCoord(BakedLayout.Stairs[i]);
+		if (BakedLayout.StairRooms.IsValidIndex(i))
 		{
-			FCoord PossibleLocation = Room.GlobalCentre + PossibleLocationOffset;
-
-			// Get Global Coords for this hypothetical dungeon
-			bool CanUse = true;
-			for (FCoord LocalOffsetFromPotentialCentre : NewRoomLocalCoords)
-			{
-				FCoord PotentialGlobalCoord = LocalOffsetFromPotentialCentre + PossibleLocation;
-				if (RoomLayoutUsedCoords.Contains(PotentialGlobalCoord))
-				{
-					CanUse = false;
-				}
-			}
-			if (CanUse)
-			{
-				PlaceableLocations.Add(PossibleLocation);
-			}
-			
+			Stair.LowerRoomIndex = BakedLayout.StairRooms[i].X;
+			Stair.UpperRoomIndex = BakedLayout.StairRooms[i].Y;
 		}
+		Generation.Stairs.Add(Stair);
 	}
+}
 
-	//UE_LOG(LogTemp, Warning, TEXT("After filtering out locations, %d possible room origins remain."), PlaceableLocations.Num())
-
-	// Sort these locations by EUCLIDEAN distance from 0,0
-	TArray<FCoord> ListOfSpawnLocations =  PlaceableLocations.Array();
-	// Shuffles so order of added locations do not matter
-
-	// TODO make choice of position dependant on input - also change size of room selected
-	ListOfSpawnLocations.Sort([this](const FCoord &Item1, const FCoord &Item2) {
-		return FMath::FRand() < 0.5f;
-	});
-
-	// Sort to get closest first
-	// ListOfSpawnLocations.Sort();
-
-	// UE_LOG(LogTemp, Error, TEXT("Found %d possible room locations!"), ListOfSpawnLocations.Num())
-	
-	// Perform weighted random selection
-	// Temp implementation just picks closest
-	const FCoord RoomCentre = ListOfSpawnLocations[0];
-	
-	// Place new random room layout in new location, and print coords
-	FDungeonRoom NewRoom = FDungeonRoom(RoomCentre, NewRoomLocalCoords, NewRoomIndex);
-	RoomLayout.Add(NewRoom);
-	
-	// Update global set of coord tiles
-	for (FCoord LocalCoord : NewRoom.LocalCoordOffsets)
+bool ADungeonGenerator::HasSpawnedLayout() const
+{
+	if (LevelCounts.Num() != LevelActors.Num()) return false;
+	if (const FDungeonBakedLayout* BakedLayout = GetSpawnedBakedLayout())
 	{
-		RoomLayoutUsedCoords.Add(LocalCoord+NewRoom.GlobalCentre);
+		return BakedLayout->Levels.Num() == LevelActors.Num() && Generation.Stairs.Num() == BakedLayout->Stairs.Num();
 	}
+	return Generation.Levels.Num() == LevelActors.Num();
 }
 
-
-void ADungeonGenerator::SpawnMeshes(const TArray<FDungeonRoom>& RoomLayout)
+bool ADungeonGenerator::RestoreSpawnedLayout()
 {
-	TMap<FCoord, int> TilesUsed;
-	
-	// For every tile of every room, spawn a floor tile
-	for (int RoomIndex = 0; RoomIndex < RoomLayout.Num(); RoomIndex++)
+	if (HasSpawnedLayout()) return true;
+
+	if (SpawnedNumRooms <= 0 || SpawnedSettingsHash != GetLayoutSettingsHash())
 	{
-		FDungeonRoom Room = RoomLayout[RoomIndex];
+		UE_LOG(LogTemp, Warning, TEXT("The dungeon's layout wasn't saved with it and the settings it was spawned with have changed. Generate it again to stream its levels."))
+		return false;
+	}
+
+	const FDungeonBakedLayout* BakedLayout = GetSpawnedBakedLayout();
+	if (BakedLayout && BakedLayout->Seed == SpawnedSeed && BakedLayout->NumRooms == SpawnedNumRooms &&
+		BakedLayout->SettingsHash == SpawnedSettingsHash && BakedLayout->Levels.Num() == LevelActors.Num())
+	{
+		InitBakedStairs(*BakedLayout);
+		UpdateLevelCounts();
+		return true;
+	}
+
+	// Baked layouts come from the same generation, so if the library was rebaked since, the layout is generated again
+	FDungeonGeneration RestoredGeneration;
+	if (!BuildGeneration(SpawnedSeed, SpawnedNumRooms, RestoredGeneration) || RestoredGeneration.Levels.Num() != LevelActors.Num())
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Couldn't rebuild the dungeon's layout with the current settings. Generate it again to stream its levels."))
+		return false;
+	}
+	SpawnedLayoutLibrary = nullptr;
+	SpawnedBakedLayoutIndex = INDEX_NONE;
+	Generation = MoveTemp(RestoredGeneration);
+	UpdateLevelCounts();
+	UE_LOG(LogTemp, Display, TEXT("Rebuilt the layout of the spawned dungeon (seed %d)"), SpawnedSeed)
+	return true;
+}
+
+void ADungeonGenerator::BakeLevel(const FDungeonGeneration& SourceGeneration, const int Level, FDungeonBakedLevel& OutLevel) const
+{
+	FMemMark Mark(FMemStack::Get());
+	const FDungeonLayout& RoomLayout = SourceGeneration.Levels[Level];
+
+	OutLevel = FDungeonBakedLevel();
+	OutLevel.RoomCentres.Reserve(RoomLayout.Rooms.Num());
+	OutLevel.RoomTileCounts.Reserve(RoomLayout.Rooms.Num());
+	OutLevel.RoomTiles.Reserve(RoomLayout.TileOwners.Num());
+
+	// Replay the rooms in order, the same way spawning them one by one would add and remove walls
+	TDungeonScratchSet<FCoordPair> Walls;
+	for (int RoomIndex = 0; RoomIndex < RoomLayout.Rooms.Num(); RoomIndex++)
+	{
+		const FDungeonRoom& Room = RoomLayout.Rooms[RoomIndex];
+		OutLevel.RoomCentres.Add(Room.GlobalCentre.ToIntVector());
+		OutLevel.RoomTileCounts.Add(Room.LocalCoordOffsets.Num());
 		for (const FCoord LocalOffset : Room.LocalCoordOffsets)
 		{
-			TilesUsed.Add(Room.GlobalCentre+LocalOffset, RoomIndex);
-			
-			const int X = Room.GlobalCentre.X + LocalOffset.X;
-			const int Y = Room.GlobalCentre.Y + LocalOffset.Y;
-			FVector SpawnLocation = FVector(X*FloorMeshWidth, Y*FloorMeshWidth, 0);
-			
-			// Doing by spawning actors
-			AActor* NewTile = GetWorld()->SpawnActor<AActor>(FloorActor, SpawnLocation, FRotator(0, 0, 0));
-			//AStaticMeshActor* NewMesh = GetWorld()->SpawnActor<AStaticMeshActor>(SpawnLocation, FRotator(0, 0, 0));
-			//NewMesh->GetStaticMeshComponent()->SetStaticMesh(FloorMesh);
+			OutLevel.RoomTiles.Add((Room.GlobalCentre + LocalOffset).ToIntVector());
+		}
+
+		TDungeonScratchArray<FCoordPair> NewWalls;
+		TDungeonScratchArray<FCoordPair> Archways;
+		GetRoomWallChanges(RoomLayout, RoomIndex, NewWalls, Archways);
+		Walls.Append(NewWalls);
+		for (const FCoordPair Archway : Archways)
+		{
+			Walls.Remove(Archway);
+			OutLevel.NumDoorways++;
+		}
+	}
+
+	OutLevel.Walls.Reserve(Walls.Num() * 2);
+	for (const FCoordPair Wall : Walls)
+	{
+		OutLevel.Walls.Add(Wall.A.ToIntVector());
+		OutLevel.Walls.Add(Wall.B.ToIntVector());
+	}
+}
+
+void ADungeonGenerator::InitStairs(FDungeonGeneration& NewGeneration) const
+{
+	NewGeneration.Stairs.Reset();
+
+	const FDungeonRoomVariant& StartRoom = NewGeneration.RoomVariants[NewGeneration.Levels[0].Rooms[0].PossibleRoomsIndex];
+	// Salted so the stairs don't follow the same sequence as the room catalogue shuffle
+	constexpr uint32 StairSalt = 0x5374;
+	FRandomStream StairStream(static_cast<int32>(HashCombine(GetTypeHash(NewGeneration.Seed), StairSalt)));
+	for (int Level = 0; Level + 1 < NewGeneration.Levels.Num(); Level++)
+	{
+		// Avoid putting a stair straight over the one coming up from the level below, if the room has space
+		FCoord StairTile = StartRoom.Tiles[StairStream.RandRange(0, StartRoom.Tiles.Num()-1)];
+		if (Level > 0 && StartRoom.Tiles.Num() > 1)
+		{
+			const FCoord StairBelow = NewGeneration.Stairs[Level-1].LowerTile;
+			while (StairTile.X == StairBelow.X && StairTile.Y == StairBelow.Y)
+			{
+				StairTile = StartRoom.Tiles[StairStream.RandRange(0, StartRoom.Tiles.Num()-1)];
+			}
+		}
+
+		FDungeonStair Stair;
+		Stair.LowerTile = FCoord(StairTile.X, StairTile.Y, Level);
+		Stair.LowerRoomIndex = NewGeneration.Levels[Level].TileOwners.FindChecked(Stair.LowerTile);
+		Stair.UpperRoomIndex = NewGeneration.Levels[Level+1].TileOwners.FindChecked(FCoord(StairTile.X, StairTile.Y, Level+1));
+		NewGeneration.Stairs.Add(Stair);
+	}
+}
+
+void ADungeonGenerator::FillLayout(FDungeonLayout& RoomLayout, const int NumRooms) const
+{
+	// Recursively place rest down
+	while (RoomLayout.Rooms.Num() < NumRooms)
+	{
+		FRandomStream RoomStream = GetRoomRandomStream(RoomLayout, RoomLayout.Rooms.Num());
+		if (!AddSingleRoomToLayout(RoomLayout, RoomStream))
+		{
+			UE_LOG(LogTemp, Error, TEXT("Could not place room %d of %d on level %d, stopping with the rooms placed so far."), RoomLayout.Rooms.Num()+1, NumRooms, RoomLayout.Level)
+			break;
+		}
+	}
+}
+
+void ADungeonGenerator::UpdateLayout()
+{
+	check(CanUpdateLayout());
+
+	const int NumRooms = NumOfRoomsToGenerate;
+	if ((NumRooms <= 0) || (NumRooms > 100))
+	{
+		UE_LOG(LogTemp, Error, TEXT("NumRooms out of bounds (%d). Should be between 1 and 100. Exiting..."), NumRooms);
+		return;
+	}
+
+	FMemMark GenerationMark(FMemStack::Get());
+	TArray<FDungeonLayout>& Levels = Generation.Levels;
+
+	TArray<int, TInlineAllocator<8>> StartNumRooms;
+	for (const FDungeonLayout& RoomLayout : Levels)
+	{
+		StartNumRooms.Add(RoomLayout.Rooms.Num());
+	}
+
+	// Rooms only depend on the rooms placed before them, so shrinking just removes rooms from the end
+	for (int Level = 0; Level < Levels.Num(); Level++)
+	{
+		while (Levels[Level].Rooms.Num() > NumRooms)
+		{
+			RemoveLastRoom(Level);
+		}
+	}
+
+	// Rooms that are kept only need moving if the tile size or level height changed
+	if (CachedFloorMeshWidth != FloorMeshWidth || CachedLevelHeight != LevelHeight)
+	{
+		UpdateMeshTransforms();
+		CachedFloorMeshWidth = FloorMeshWidth;
+		CachedLevelHeight = LevelHeight;
+	}
+
+	// Growing carries on placing rooms where the last generation stopped, then spawns just the new rooms
+	TArray<int, TInlineAllocator<8>> OldNumRooms;
+	for (const FDungeonLayout& RoomLayout : Levels)
+	{
+		OldNumRooms.Add(RoomLayout.Rooms.Num());
+	}
+	ParallelFor(Levels.Num(), [this, &Levels, NumRooms](const int32 Level)
+	{
+		FMemMark LevelMark(FMemStack::Get());
+		FillLayout(Levels[Level], NumRooms);
+	});
+
+	// Only levels that gained or lost rooms need recounting
+	for (int Level = 0; Level < Levels.Num(); Level++)
+	{
+		if (Levels[Level].Rooms.Num() != StartNumRooms[Level])
+		{
+			LevelCounts[Level] = CountLevel(Level);
+		}
+	}
+
+	// Check the grown dungeon still fits before spawning any of it
+	const bool bWasInstanced = bSpawnInstancedMeshes;
+	const bool bIsWithinBudget = ApplyBudget();
+	LogGenerationReport();
+	if (!bIsWithinBudget)
+	{
+		// None of the new rooms are spawned yet, so they only need removing from the layout
+		for (int Level = 0; Level < Levels.Num(); Level++)
+		{
+			if (Levels[Level].Rooms.Num() == OldNumRooms[Level]) { continue; }
+			while (Levels[Level].Rooms.Num() > OldNumRooms[Level])
+			{
+				Levels[Level].RemoveLastRoom();
+			}
+			LevelCounts[Level] = CountLevel(Level);
+		}
+		UE_LOG(LogTemp, Error, TEXT("Growing the dungeon to %d rooms per level is over budget, kept the existing rooms instead."), NumRooms)
+		GenerationReport = BuildGenerationReport(bSpawnInstancedMeshes);
+		GenerationReport.bWasAborted = true;
+		return;
+	}
+	SpawnedNumRooms = NumRooms;
+	if (bSpawnInstancedMeshes != bWasInstanced)
+	{
+		// Switched to instances to stay within the budget, so every streamed in level is respawned that way
+		for (int Level = 0; Level < LevelActors.Num(); Level++)
+		{
+			if (!LevelActors[Level].bIsSpawned) { continue; }
+			DestroyLevelMeshes(Level);
+			SpawnLevelMeshes(Level);
+		}
+		return;
+	}
+
+	for (int Level = 0; Level < Levels.Num(); Level++)
+	{
+		if (!LevelActors[Level].bIsSpawned) { continue; }
+
+		// Instances are cheap to upload, so a changed level just has all of them replaced
+		if (bSpawnInstancedMeshes)
+		{
+			if (Levels[Level].Rooms.Num() != StartNumRooms[Level])
+			{
+				RebuildLevelInstances(Level);
+			}
+			continue;
+		}
+		for (int RoomIndex = OldNumRooms[Level]; RoomIndex < Levels[Level].Rooms.Num(); RoomIndex++)
+		{
+			SpawnRoomMeshes(Level, RoomIndex);
+		}
+	}
+}
+
+TArray<FDungeonRoomVariant> ADungeonGenerator::InitPossibleRooms(FRandomStream& RandomStream) const
+{
+	// Init
+	TArray<FDungeonRoomVariant> AlLRooms;
+
+	// Variants are worked out when each shape asset is edited, so they only need collecting here
+	for (const UDungeonRoomShapeAsset* RoomShape : RoomShapes)
+	{
+		if (!RoomShape || !RoomShape->HasValidTiles()) { continue; }
+		AlLRooms.Append(RoomShape->Variants);
+	}
+
+	if (RoomShapes.IsEmpty())
+	{
+		//Iterate over every rectangle between 2 and 3 tiles dimension
+		 constexpr int MinSize = 2;
+		 constexpr int MaxSize = 3;
+		 for (int Width = MinSize; Width <= MaxSize; Width++)
+		 {
+		 	for (int Height = MinSize; Height <= MaxSize; Height++)
+		 	{
+		 		int W_Pos, W_Neg, H_Pos, H_Neg;
+		 		if (Width % 2 == 0)
+		 		{
+		 			W_Pos = Width/2;
+		 			W_Neg = -Width/2 + 1;
+		 		} else
+		 		{
+		 			W_Pos = Width/2;
+		 			W_Neg = -Width/2;
+		 		}
+		 		if (Height % 2 == 0)
+		 		{
+		 			H_Pos = Height/2 + 1;
+		 			H_Neg = -Height/2;
+		 		} else
+		 		{
+		 			H_Pos = Height/2;
+		 			H_Neg = -Height/2;
+		 		}
 	
-			FloorActors.Push(NewTile);
+		 		TArray<FCoord> RoomOffsetLayout;
+		 		for (int W = W_Neg; W <= W_Pos; W++)
+		 		{
+		 			for (int H = H_Neg; H <= H_Pos; H++)
+		 			{
+		 				RoomOffsetLayout.Add(FCoord(W,H));
+		 			}
+		 		}
+		 		FDungeonRoomVariant Variant;
+		 		FDungeonRoomVariant::Build(RoomOffsetLayout, Variant);
+		 		AlLRooms.Add(MoveTemp(Variant));
+		 	}
+		 }
+	}
+
+
+	UE_LOG(LogTemp, Warning, TEXT("Total generated possible rooms: %d"), AlLRooms.Num());
+
+	// Shuffle so a different selection of rooms is used for each seed
+	for (int i = AlLRooms.Num()-1; i > 0; i--)
+	{
+		AlLRooms.Swap(i, RandomStream.RandRange(0, i));
+	}
+
+	// Optionally only use a random subset of the rooms in this generation
+	if (MaxRoomVariantsInGeneration > 0 && AlLRooms.Num() > MaxRoomVariantsInGeneration)
+	{
+		AlLRooms.SetNum(MaxRoomVariantsInGeneration);
+	}
+	UE_LOG(LogTemp, Warning, TEXT("Total sampled possible rooms for actual generation: %d"), AlLRooms.Num());
+	return AlLRooms;
+}
+
+bool ADungeonGenerator::AddSingleRoomToLayout(FDungeonLayout& RoomLayout, FRandomStream& RandomStream) const
+{
+	FMemMark Mark(FMemStack::Get());
+	const TArrayView<const FDungeonRoomVariant> PossibleRooms = RoomLayout.PossibleRooms;
+
+	// Try the room layouts in a random order until one of them fits somewhere (will be RoomB, placing room)
+	TDungeonScratchArray<int> NewRoomIndexOrder;
+	NewRoomIndexOrder.Reserve(PossibleRooms.Num());
+	for (int i = 0; i < PossibleRooms.Num(); i++)
+	{
+		NewRoomIndexOrder.Add(i);
+	}
+	for (int i = NewRoomIndexOrder.Num()-1; i > 0; i--)
+	{
+		NewRoomIndexOrder.Swap(i, RandomStream.RandRange(0, i));
+	}
+
+	// Every unused tile bordering the layout. The new room touches the layout exactly when one of its tiles lands on
+	// one of these. Gathered room by room so the order only depends on the rooms placed so far.
+	TDungeonScratchArray<FCoord> FrontierTiles;
+	{
+		TDungeonScratchSet<FCoord> SeenFrontierTiles;
+		for (const FDungeonRoom& Room : RoomLayout.Rooms)
+		{
+			for (const FDungeonRoomEdge& Edge : PossibleRooms[Room.PossibleRoomsIndex].PerimeterEdges)
+			{
+				const FCoord OutsideTile = Edge.Outside + Room.GlobalCentre;
+				if (RoomLayout.Occupancy.Contains(OutsideTile)) { continue; }
+
+				bool bWasSeen = false;
+				SeenFrontierTiles.Add(OutsideTile, &bWasSeen);
+				if (!bWasSeen)
+				{
+					FrontierTiles.Add(OutsideTile);
+				}
+			}
+		}
+	}
+
+	for (const int NewRoomIndex : NewRoomIndexOrder)
+	{
+		const FDungeonRoomVariant& NewRoom = PossibleRooms[NewRoomIndex];
+
+		// Line each tile of the new room up with each frontier tile, and keep the centres that don't overlap anything
+		FDungeonCandidateBatch Candidates;
+		TDungeonScratchSet<FCoord> TestedLocations;
+		for (const FCoord FrontierTile : FrontierTiles)
+		{
+			for (const FCoord LocalCoord : NewRoom.Tiles)
+			{
+				const FCoord PossibleLocation = FrontierTile + LocalCoord.Inverse();
+
+				bool bWasTested = false;
+				TestedLocations.Add(PossibleLocation, &bWasTested);
+				if (bWasTested) { continue; }
+
+				if (!RoomLayout.Occupancy.Overlaps(NewRoom, PossibleLocation))
+				{
+					Candidates.Locations.Add(PossibleLocation);
+				}
+			}
+		}
+
+		// This room doesn't fit anywhere, so try the next one
+		if (Candidates.Num() == 0) { continue; }
+
+		BuildCandidateBatch(NewRoom, RoomLayout, Candidates);
+
+		TDungeonScratchArray<float> Scores;
+		Scores.SetNumUninitialized(Candidates.Num());
+		ScoreCandidates(Candidates, Scores);
+		const FCoord RoomCentre = Candidates.Locations[PickWeightedCandidate(Scores, RandomStream)];
+
+		// Place new random room layout in new location
+		RoomLayout.AddRoom(RoomCentre, NewRoomIndex);
+		return true;
+	}
+
+	UE_LOG(LogTemp, Warning, TEXT("None of the %d possible rooms fit around the current layout."), PossibleRooms.Num())
+	return false;
+}
+
+EDungeonCandidateTerms ADungeonGenerator::GetRequiredCandidateTerms() const
+{
+	EDungeonCandidateTerms Terms = EDungeonCandidateTerms::None;
+	if (PlacementWeights.TouchingRooms != 0.f) Terms |= EDungeonCandidateTerms::TouchingRooms;
+	if (PlacementWeights.BoundsGrowth != 0.f) Terms |= EDungeonCandidateTerms::BoundsGrowth;
+	return Terms;
+}
+
+void ADungeonGenerator::BuildCandidateBatch(const FDungeonRoomVariant& NewRoom, const FDungeonLayout& RoomLayout, FDungeonCandidateBatch& Candidates) const
+{
+	const int NumCandidates = Candidates.Num();
+	Candidates.DistanceToOrigin.SetNumUninitialized(NumCandidates);
+	Candidates.TouchingRooms.SetNumZeroed(NumCandidates);
+	Candidates.BoundsGrowth.SetNumZeroed(NumCandidates);
+
+	for (int i = 0; i < NumCandidates; i++)
+	{
+		const FCoord Location = Candidates.Locations[i];
+		Candidates.DistanceToOrigin[i] = FCoord::GetEuclideanDistanceBetweenCoords(Location, FCoord(0, 0, Location.Z));
+	}
+
+	// The remaining terms need a pass over every tile of every candidate, so skip them when they aren't scored
+	const EDungeonCandidateTerms RequiredTerms = GetRequiredCandidateTerms();
+	if (EnumHasAnyFlags(RequiredTerms, EDungeonCandidateTerms::TouchingRooms))
+	{
+		for (int i = 0; i < NumCandidates; i++)
+		{
+			// Rooms only have a handful of neighbours, so a small inline array beats a set here
+			TArray<int, TInlineAllocator<8>> TouchedRooms;
+			for (const FDungeonRoomEdge& Edge : NewRoom.PerimeterEdges)
+			{
+				if (const int* OwnerIndex = RoomLayout.TileOwners.Find(Edge.Outside+Candidates.Locations[i]))
+				{
+					TouchedRooms.AddUnique(*OwnerIndex);
+				}
+			}
+			Candidates.TouchingRooms[i] = TouchedRooms.Num();
 		}
 	}
 
+	if (EnumHasAnyFlags(RequiredTerms, EDungeonCandidateTerms::BoundsGrowth))
+	{
+		// Inclusive bounding boxes of the current layout and of the new room around its own centre
+		FCoord LayoutMin(MAX_int32, MAX_int32), LayoutMax(MIN_int32, MIN_int32);
+		for (const FDungeonRoom& Room : RoomLayout.Rooms)
+		{
+			const FDungeonRoomVariant& Variant = RoomLayout.PossibleRooms[Room.PossibleRoomsIndex];
+			LayoutMin = FCoord(FMath::Min(LayoutMin.X, Room.GlobalCentre.X + Variant.BoundsMin.X), FMath::Min(LayoutMin.Y, Room.GlobalCentre.Y + Variant.BoundsMin.Y));
+			LayoutMax = FCoord(FMath::Max(LayoutMax.X, Room.GlobalCentre.X + Variant.BoundsMax.X), FMath::Max(LayoutMax.Y, Room.GlobalCentre.Y + Variant.BoundsMax.Y));
+		}
+		const FCoord RoomMin = NewRoom.BoundsMin;
+		const FCoord RoomMax = NewRoom.BoundsMax;
+		const float LayoutArea = (LayoutMax.X - LayoutMin.X + 1.f) * (LayoutMax.Y - LayoutMin.Y + 1.f);
 
-	// Initialise a graph for the room layout, and connections between rooms calculated when finding wall coordinates
-	TArray<TArray<TSet<FCoordPair>>> AdjacencyMap;
-	for (int i = 0; i < RoomLayout.Num(); i++)
+		for (int i = 0; i < NumCandidates; i++)
+		{
+			const FCoord Centre = Candidates.Locations[i];
+			const float Width = FMath::Max(LayoutMax.X, Centre.X + RoomMax.X) - FMath::Min(LayoutMin.X, Centre.X + RoomMin.X) + 1.f;
+			const float Height = FMath::Max(LayoutMax.Y, Centre.Y + RoomMax.Y) - FMath::Min(LayoutMin.Y, Centre.Y + RoomMin.Y) + 1.f;
+			Candidates.BoundsGrowth[i] = Width * Height - LayoutArea;
+		}
+	}
+}
+
+void ADungeonGenerator::ScoreCandidates(const FDungeonCandidateBatch& Candidates, TArrayView<float> OutScores) const
+{
+	check(OutScores.Num() == Candidates.Num());
+
+	// Branch-free loop over plain arrays so the compiler can vectorise it
+	const float DistanceWeight = PlacementWeights.DistanceToOrigin;
+	const float TouchingWeight = PlacementWeights.TouchingRooms;
+	const float GrowthWeight = PlacementWeights.BoundsGrowth;
+	const float* RESTRICT Distance = Candidates.DistanceToOrigin.GetData();
+	const float* RESTRICT Touching = Candidates.TouchingRooms.GetData();
+	const float* RESTRICT Growth = Candidates.BoundsGrowth.GetData();
+	float* RESTRICT Scores = OutScores.GetData();
+	const int NumCandidates = Candidates.Num();
+	for (int i = 0; i < NumCandidates; i++)
+	{
+		Scores[i] = DistanceWeight * Distance[i] + TouchingWeight * Touching[i] + GrowthWeight * Growth[i];
+	}
+}
+
+int ADungeonGenerator::PickWeightedCandidate(TArrayView<const float> Scores, FRandomStream& RandomStream) const
+{
+	check(Scores.Num() > 0);
+
+	// Subtract the best score before exponentiating so the weights can't overflow, then sample from the prefix sums
+	float MaxScore = Scores[0];
+	for (const float Score : Scores)
+	{
+		MaxScore = FMath::Max(MaxScore, Score);
+	}
+
+	FMemMark Mark(FMemStack::Get());
+	TDungeonScratchArray<float> CumulativeWeights;
+	CumulativeWeights.SetNumUninitialized(Scores.Num());
+	float TotalWeight = 0.f;
+	for (int i = 0; i < Scores.Num(); i++)
+	{
+		TotalWeight += FMath::Exp(PlacementWeights.Sharpness * (Scores[i] - MaxScore));
+		CumulativeWeights[i] = TotalWeight;
+	}
+
+	const float Target = RandomStream.FRand() * TotalWeight;
+	const int PickedIndex = Algo::UpperBound(CumulativeWeights, Target);
+	return FMath::Min(PickedIndex, Scores.Num()-1);
+}
+
+
+void ADungeonGenerator::SpawnMeshes()
+{
+	for (int Level = 0; Level < LevelActors.Num(); Level++)
 	{
-		TArray<TSet<FCoordPair>> Connections;
-		Connections.Init(TSet<FCoordPair>(), RoomLayout.Num());
-		AdjacencyMap.Add(Connections);
+		if (ShouldLevelBeSpawned(Level))
+		{
+			SpawnLevelMeshes(Level);
+		}
 	}
+}
+
+bool ADungeonGenerator::ShouldLevelBeSpawned(const int Level) const
+{
+	return LevelStreamingRadius < 0 || FMath::Abs(Level - ActiveLevel) <= LevelStreamingRadius;
+}
+
+void ADungeonGenerator::SpawnLevelMeshes(const int Level)
+{
+	FDungeonLevelActors& Actors = LevelActors[Level];
+	check(!Actors.bIsSpawned);
+	Actors.bIsSpawned = true;
+
+	if (bSpawnInstancedMeshes)
+	{
+		RebuildLevelInstances(Level);
+	}
+	else if (const FDungeonBakedLayout* BakedLayout = GetSpawnedBakedLayout())
+	{
+		SpawnBakedLevelActors(Level, BakedLayout->Levels[Level]);
+	}
+	else
+	{
+		for (int RoomIndex = 0; RoomIndex < Generation.Levels[Level].Rooms.Num(); RoomIndex++)
+		{
+			SpawnRoomMeshes(Level, RoomIndex);
+		}
+	}
+
+	// Stairs are optional, the openings above them are left either way
+	if (!StairActor) return;
+	for (const FDungeonStair& Stair : Generation.Stairs)
+	{
+		if (Stair.LowerTile.Z != Level) { continue; }
+		Actors.StairActors.Push(GetWorld()->SpawnActor<AActor>(StairActor, GetFloorLocation(Stair.LowerTile), FRotator(0, 0, 0)));
+	}
+}
+
+void ADungeonGenerator::DestroyLevelMeshes(const int Level)
+{
+	FDungeonLevelActors& Actors = LevelActors[Level];
+	for (AActor* Mesh : Actors.FloorActors)
+	{
+		if (IsValid(Mesh)) Mesh->Destroy();
+	}
+	for (const TPair<FCoordPair, AActor*>& Wall : Actors.WallActors)
+	{
+		if (IsValid(Wall.Value)) Wall.Value->Destroy();
+	}
+	for (AActor* Mesh : Actors.StairActors)
+	{
+		if (IsValid(Mesh)) Mesh->Destroy();
+	}
+	for (AActor* Mesh : Actors.LegacyActors)
+	{
+		if (IsValid(Mesh)) Mesh->Destroy();
+	}
+	if (IsValid(Actors.FloorInstances)) Actors.FloorInstances->DestroyComponent();
+	if (IsValid(Actors.WallInstances)) Actors.WallInstances->DestroyComponent();
+	Actors = FDungeonLevelActors();
+}
+
+void ADungeonGenerator::SpawnRoomMeshes(const int Level, const int RoomIndex)
+{
+	FMemMark Mark(FMemStack::Get());
+
+	const FDungeonLayout& RoomLayout = Generation.Levels[Level];
+	const FDungeonRoom& Room = RoomLayout.Rooms[RoomIndex];
+	FDungeonLevelActors& Actors = LevelActors[Level];
 	
+	// For every tile of the room, spawn a floor tile
+	for (const FCoord LocalOffset : Room.LocalCoordOffsets)
+	{
+		const FCoord Tile = Room.GlobalCentre + LocalOffset;
+
+		// Leave a hole for the stair coming up from below, but keep the entry so tiles still line up with the rooms
+		if (IsStairOpening(Tile))
+		{
+			Actors.FloorActors.Push(nullptr);
+			continue;
+		}
+
+		// Doing by spawning actors
+		AActor* NewTile = GetWorld()->SpawnActor<AActor>(FloorActor, GetFloorLocation(Tile), FRotator(0, 0, 0));
+		//AStaticMeshActor* NewMesh = GetWorld()->SpawnActor<AStaticMeshActor>(SpawnLocation, FRotator(0, 0, 0));
+		//NewMesh->GetStaticMeshComponent()->SetStaticMesh(FloorMesh);
 	
-	// Find unique wall coordinates
-	TSet<FCoordPair> WallLocations;
-	for (FDungeonRoom Room : RoomLayout)
+		Actors.FloorActors.Push(NewTile);
+	}
+
+	TDungeonScratchArray<FCoordPair> NewWalls;
+	TDungeonScratchArray<FCoordPair> Archways;
+	GetRoomWallChanges(RoomLayout, RoomIndex, NewWalls, Archways);
+	for (const FCoordPair Wall : NewWalls)
+	{
+		SpawnWall(Level, Wall);
+	}
+	for (const FCoordPair Archway : Archways)
+	{
+		DestroyWall(Level, Archway);
+	}
+}
+
+void ADungeonGenerator::GetRoomWallChanges(const FDungeonLayout& RoomLayout, const int RoomIndex, TDungeonScratchArray<FCoordPair>& OutNewWalls, TDungeonScratchArray<FCoordPair>& OutArchways) const
+{
+	const FDungeonRoom& Room = RoomLayout.Rooms[RoomIndex];
+
+	// Walls between this room and each earlier room it touches, keyed by the earlier room's index
+	TDungeonScratchMap<int, TDungeonScratchArray<FCoordPair>> ConnectingWalls;
+
+	// Every edge between a tile in the room and a tile outside of it has a wall
+	for (const FDungeonRoomEdge& Edge : RoomLayout.PossibleRooms[Room.PossibleRoomsIndex].PerimeterEdges)
+	{
+		const FCoord ThisTile = Room.GlobalCentre + Edge.Inside;
+		const FCoord NeighborTile = Room.GlobalCentre + Edge.Outside;
+		const int* NeighborRoomIndex = RoomLayout.TileOwners.Find(NeighborTile);
+
+		const FCoordPair Wall = FCoordPair(ThisTile, NeighborTile);
+		if (NeighborRoomIndex && *NeighborRoomIndex < RoomIndex)
+		{
+			// The earlier room already has this wall, so just store it as one of the connecting walls
+			ConnectingWalls.FindOrAdd(*NeighborRoomIndex).Add(Wall);
+		}
+		else
+		{
+			OutNewWalls.Add(Wall);
+		}
+	}
+
+	// For every room connection, take one of the connecting walls out to make an archway
+	for (TPair<int, TDungeonScratchArray<FCoordPair>>& Connection : ConnectingWalls)
+	{
+		OutArchways.Add(PickArchway(RoomLayout, Connection.Key, RoomIndex, Connection.Value));
+	}
+}
+
+void ADungeonGenerator::SpawnBakedLevelActors(const int Level, const FDungeonBakedLevel& BakedLevel)
+{
+	FDungeonLevelActors& Actors = LevelActors[Level];
+
+	Actors.FloorActors.Reserve(BakedLevel.RoomTiles.Num());
+	for (const FIntVector& TileVector : BakedLevel.RoomTiles)
 	{
-		// For every tile in the room, find all adjacent tiles that are NOT in the room.
-		for (FCoord LocalOffset : Room.LocalCoordOffsets)
+		const FCoord Tile(TileVector);
+		if (IsStairOpening(Tile))
 		{
-			for (FCoord AdjacentTile : FCoord::Get4AdjacentTiles(LocalOffset))
+			Actors.FloorActors.Push(nullptr);
+			continue;
+		}
+		Actors.FloorActors.Push(GetWorld()->SpawnActor<AActor>(FloorActor, GetFloorLocation(Tile), FRotator(0, 0, 0)));
+	}
+
+	Actors.WallActors.Reserve(BakedLevel.Walls.Num() / 2);
+	for (int i = 0; i + 1 < BakedLevel.Walls.Num(); i += 2)
+	{
+		SpawnWall(Level, FCoordPair(FCoord(BakedLevel.Walls[i]), FCoord(BakedLevel.Walls[i+1])));
+	}
+}
+
+void ADungeonGenerator::RebuildLevelInstances(const int Level)
+{
+	FDungeonLevelActors& Actors = LevelActors[Level];
+
+	// A generated level is flattened the same way it would be baked, so both are uploaded the same way
+	FDungeonBakedLevel GeneratedLevel;
+	const FDungeonBakedLevel* BakedLevel = nullptr;
+	if (const FDungeonBakedLayout* BakedLayout = GetSpawnedBakedLayout())
+	{
+		BakedLevel = &BakedLayout->Levels[Level];
+	}
+	else
+	{
+		BakeLevel(Generation, Level, GeneratedLevel);
+		BakedLevel = &GeneratedLevel;
+	}
+
+	TArray<FTransform> FloorTransforms;
+	FloorTransforms.Reserve(BakedLevel->RoomTiles.Num());
+	for (const FIntVector& TileVector : BakedLevel->RoomTiles)
+	{
+		const FCoord Tile(TileVector);
+		if (IsStairOpening(Tile)) { continue; }
+		FloorTransforms.Add(FTransform(GetFloorLocation(Tile)));
+	}
+
+	TArray<FTransform> WallTransforms;
+	WallTransforms.Reserve(BakedLevel->Walls.Num() / 2);
+	for (int i = 0; i + 1 < BakedLevel->Walls.Num(); i += 2)
+	{
+		WallTransforms.Add(GetWallTransform(FCoordPair(FCoord(BakedLevel->Walls[i]), FCoord(BakedLevel->Walls[i+1]))));
+	}
+
+	SetInstances(Actors.FloorInstances, FloorMesh, FloorTransforms);
+	SetInstances(Actors.WallInstances, WallMesh, WallTransforms);
+}
+
+void ADungeonGenerator::SetInstances(TObjectPtr<UInstancedStaticMeshComponent>& Component, UStaticMesh* Mesh, const TArray<FTransform>& Transforms)
+{
+	if (!IsValid(Component))
+	{
+		Component = NewObject<UInstancedStaticMeshComponent>(this);
+		Component->SetupAttachment(GetRootComponent());
+		Component->RegisterComponent();
+		AddInstanceComponent(Component);
+	}
+	Component->SetStaticMesh(Mesh);
+	Component->ClearInstances();
+	Component->AddInstances(Transforms, false, true);
+}
+
+void ADungeonGenerator::RemoveLastRoom(const int Level)
+{
+	FDungeonLayout& RoomLayout = Generation.Levels[Level];
+	FDungeonLevelActors& Actors = LevelActors[Level];
+
+	// A level that is streamed out has no meshes to update, and instances are rebuilt once all rooms are removed
+	if (Actors.bIsSpawned && !bSpawnInstancedMeshes)
+	{
+		const FDungeonRoom& Room = RoomLayout.Rooms.Last();
+
+		// Floor tiles are spawned in room order, so this room's tiles are the last ones
+		for (int i = 0; i < Room.LocalCoordOffsets.Num(); i++)
+		{
+			AActor* Mesh = Actors.FloorActors.Pop();
+			if (IsValid(Mesh)) Mesh->Destroy();
+		}
+
+		for (const FDungeonRoomEdge& Edge : RoomLayout.PossibleRooms[Room.PossibleRoomsIndex].PerimeterEdges)
+		{
+			const FCoord ThisTile = Room.GlobalCentre + Edge.Inside;
+			const FCoord NeighborTile = Room.GlobalCentre + Edge.Outside;
+
+			const FCoordPair Wall = FCoordPair(ThisTile, NeighborTile);
+			if (RoomLayout.TileOwners.Contains(NeighborTile))
 			{
-				// If the tile is in the room, then skip it
-				if (Room.LocalCoordOffsets.Contains(AdjacentTile)) { continue; }
+				// Still a wall of the neighbouring room, so put it back if it was the archway into this room
+				if (!Actors.WallActors.Contains(Wall))
+				{
+					SpawnWall(Level, Wall);
+				}
+			}
+			else
+			{
+				DestroyWall(Level, Wall);
+			}
+		}
+	}
 
-				// Add the wall to the wall coordinates
-				const FCoord ThisTile = FCoord(Room.GlobalCentre + LocalOffset);
-				const FCoord NeighborTile = FCoord(Room.GlobalCentre + AdjacentTile);
-				WallLocations.Add(FCoordPair(ThisTile, NeighborTile));
+	RoomLayout.RemoveLastRoom();
+}
+
+void ADungeonGenerator::UpdateMeshTransforms()
+{
+	for (int Level = 0; Level < Generation.Levels.Num(); Level++)
+	{
+		FDungeonLevelActors& Actors = LevelActors[Level];
+		if (!Actors.bIsSpawned) { continue; }
 
-				// If the wall is between two rooms, add a connection between those rooms in the map graph,
-				// and store this coordinate as one of the connecting walls
-				if (TilesUsed.Contains(NeighborTile))
+		if (bSpawnInstancedMeshes)
+		{
+			RebuildLevelInstances(Level);
+		}
+		else
+		{
+			int FloorActorIndex = 0;
+			for (const FDungeonRoom& Room : Generation.Levels[Level].Rooms)
+			{
+				for (const FCoord LocalOffset : Room.LocalCoordOffsets)
 				{
-					int Tile1RoomIndex = TilesUsed[ThisTile];
-					int Tile2RoomIndex = TilesUsed[NeighborTile];
-					if (Tile2RoomIndex < Tile1RoomIndex)
-					{
-						// Swapped to ensure consistent ordering for comparisons (E.g. since A->B is not equal to B->A, we want to sort alphabetically so any B-> turns into A->B to add to the set)
-						Swap(Tile1RoomIndex, Tile2RoomIndex);
-					}
-					AdjacencyMap[Tile1RoomIndex][Tile2RoomIndex].Add(FCoordPair(ThisTile, NeighborTile));
+					AActor* Mesh = Actors.FloorActors[FloorActorIndex++];
+					if (IsValid(Mesh)) Mesh->SetActorLocation(GetFloorLocation(Room.GlobalCentre + LocalOffset));
 				}
 			}
+			for (const TPair<FCoordPair, AActor*>& Wall : Actors.WallActors)
+			{
+				if (IsValid(Wall.Value)) Wall.Value->SetActorTransform(GetWallTransform(Wall.Key));
+			}
+		}
+
+		int StairActorIndex = 0;
+		for (const FDungeonStair& Stair : Generation.Stairs)
+		{
+			if (Stair.LowerTile.Z != Level || !Actors.StairActors.IsValidIndex(StairActorIndex)) { continue; }
+			AActor* Mesh = Actors.StairActors[StairActorIndex++];
+			if (IsValid(Mesh)) Mesh->SetActorLocation(GetFloorLocation(Stair.LowerTile));
 		}
 	}
+}
 
+FCoordPair ADungeonGenerator::PickArchway(const FDungeonLayout& RoomLayout, const int RoomIndexA, const int RoomIndexB, TArrayView<FCoordPair> ConnectingWalls) const
+{
+	check(ConnectingWalls.Num() > 0);
 
-	// Find all the rooms connections.
-	// For every room connection, take a random coord out of the wall set, and place it in an archway set
-	// Spawn archways in every FCoordPair in this set
-	for (int FromRoomIndex = 0; FromRoomIndex < RoomLayout.Num(); FromRoomIndex++)
+	// Sort first so the choice doesn't depend on the order the walls were found in
+	Algo::Sort(ConnectingWalls, [](const FCoordPair& Item1, const FCoordPair& Item2)
 	{
-		for (int ToRoomIndex = 0; ToRoomIndex < RoomLayout.Num(); ToRoomIndex++)
+		if (Item1.A.X != Item2.A.X) return Item1.A.X < Item2.A.X;
+		if (Item1.A.Y != Item2.A.Y) return Item1.A.Y < Item2.A.Y;
+		if (Item1.B.X != Item2.B.X) return Item1.B.X < Item2.B.X;
+		return Item1.B.Y < Item2.B.Y;
+	});
+
+	const uint32 RoomPairHash = HashCombine(GetTypeHash(RoomIndexA), GetTypeHash(RoomIndexB));
+	FRandomStream ArchwayStream(static_cast<int32>(HashCombine(HashCombine(GetTypeHash(RoomLayout.Seed), GetTypeHash(RoomLayout.Level)), RoomPairHash)));
+	return ConnectingWalls[ArchwayStream.RandRange(0, ConnectingWalls.Num()-1)];
+}
+
+FDungeonLevelCounts ADungeonGenerator::CountLevel(const int Level) const
+{
+	FDungeonLevelCounts Counts;
+
+	// Walls and doorways of a generated level are only known once it is flattened, the same way instancing does it
+	FDungeonBakedLevel GeneratedLevel;
+	const FDungeonBakedLevel* LevelData = nullptr;
+	if (const FDungeonBakedLayout* BakedLayout = GetSpawnedBakedLayout())
+	{
+		LevelData = &BakedLayout->Levels[Level];
+		Counts.BakedLayoutBytes = LevelData->GetAllocatedSize();
+	}
+	else
+	{
+		BakeLevel(Generation, Level, GeneratedLevel);
+		LevelData = &GeneratedLevel;
+	}
+
+	Counts.NumRooms = LevelData->RoomCentres.Num();
+	Counts.NumTiles = LevelData->RoomTiles.Num();
+	for (const FIntVector& Tile : LevelData->RoomTiles)
+	{
+		if (!IsStairOpening(FCoord(Tile))) Counts.NumFloors++;
+	}
+	Counts.NumWalls = LevelData->Walls.Num() / 2;
+	Counts.NumDoorways = LevelData->NumDoorways;
+	return Counts;
+}
+
+void ADungeonGenerator::UpdateLevelCounts()
+{
+	LevelCounts.SetNum(LevelActors.Num());
+	ParallelFor(LevelCounts.Num(), [this](const int32 Level)
+	{
+		LevelCounts[Level] = CountLevel(Level);
+	});
+}
+
+FDungeonGenerationReport ADungeonGenerator::BuildGenerationReport(const bool bInstanced) const
+{
+	FDungeonGenerationReport Report;
+	Report.NumLevels = LevelActors.Num();
+	Report.NumStairs = Generation.Stairs.Num();
+	Report.LayoutBytes = Generation.GetAllocatedSize();
+	Report.bUsedInstancedMeshes = bInstanced;
+	Report.bWasDowngraded = bInstanced && !bUseInstancedMeshes;
+
+	// A dungeon loaded without its layout has no counts, so only its number of levels is known
+	int32 NumFloorsToSpawn = 0;
+	int32 NumWallsToSpawn = 0;
+	int32 NumStairsToSpawn = 0;
+	for (int Level = 0; Level < LevelCounts.Num(); Level++)
+	{
+		const FDungeonLevelCounts& Counts = LevelCounts[Level];
+		Report.NumRooms += Counts.NumRooms;
+		Report.NumTiles += Counts.NumTiles;
+		Report.NumWalls += Counts.NumWalls;
+		Report.NumDoorways += Counts.NumDoorways;
+		Report.LayoutBytes += Counts.BakedLayoutBytes;
+
+		if (!ShouldLevelBeSpawned(Level)) { continue; }
+		Report.NumSpawnedLevels++;
+		NumFloorsToSpawn += Counts.NumFloors;
+		NumWallsToSpawn += Counts.NumWalls;
+		for (const FDungeonStair& Stair : Generation.Stairs)
 		{
-			// If no connections, continue
-			if (AdjacencyMap[FromRoomIndex][ToRoomIndex].Num() == 0) { continue; }
+			if (Stair.LowerTile.Z == Level) NumStairsToSpawn++;
+		}
+	}
 
-			TArray<FCoordPair> ConnectingWalls = AdjacencyMap[FromRoomIndex][ToRoomIndex].Array();
-			FCoordPair RandomWallConnection = ConnectingWalls[FMath::RandRange(0,ConnectingWalls.Num()-1)];
+	auto AddActors = [this, &Report](const TSubclassOf<AActor> ActorClass, const int32 Count)
+	{
+		if (!ActorClass || Count == 0) return;
+		Report.ActorsPerClass.FindOrAdd(ActorClass.Get()) += Count;
+		Report.NumActors += Count;
+
+		int32 DrawCalls = 0;
+		int32 CollisionBodies = 0;
+		EstimateActorCost(ActorClass, DrawCalls, CollisionBodies);
+		Report.EstimatedDrawCalls += DrawCalls * Count;
+		Report.EstimatedCollisionBodies += CollisionBodies * Count;
+	};
+	// A mesh is drawn once per material however many instances it has, but every instance gets its own body
+	auto AddInstances = [&Report](UStaticMesh* Mesh, const int32 Count)
+	{
+		if (!Mesh || Count == 0) return;
+		Report.InstancesPerMesh.FindOrAdd(Mesh) += Count;
+		Report.NumInstances += Count;
+		Report.EstimatedDrawCalls += FMath::Max(Mesh->GetStaticMaterials().Num(), 1);
+		if (Mesh->GetBodySetup()) Report.EstimatedCollisionBodies += Count;
+	};
+
+	if (bInstanced)
+	{
+		AddInstances(FloorMesh, NumFloorsToSpawn);
+		AddInstances(WallMesh, NumWallsToSpawn);
+	}
+	else
+	{
+		AddActors(FloorActor, NumFloorsToSpawn);
+		AddActors(WallActor, NumWallsToSpawn);
+	}
+	AddActors(StairActor, NumStairsToSpawn);
+	return Report;
+}
 
-			// Remove from wall connections
-			WallLocations.Remove(RandomWallConnection);
+void ADungeonGenerator::EstimateActorCost(const TSubclassOf<AActor> ActorClass, int32& OutDrawCalls, int32& OutCollisionBodies) const
+{
+	OutDrawCalls = 0;
+	OutCollisionBodies = 0;
+
+	// Components added in a Blueprint only exist as templates on its class until an actor is spawned
+	TArray<const UPrimitiveComponent*, TInlineAllocator<8>> Primitives;
+	TInlineComponentArray<UPrimitiveComponent*> NativePrimitives;
+	ActorClass->GetDefaultObject<AActor>()->GetComponents(NativePrimitives);
+	for (const UPrimitiveComponent* Primitive : NativePrimitives)
+	{
+		Primitives.Add(Primitive);
+	}
+	for (const UClass* Class = ActorClass; Class; Class = Class->GetSuperClass())
+	{
+		const UBlueprintGeneratedClass* BlueprintClass = Cast<UBlueprintGeneratedClass>(Class);
+		if (!BlueprintClass || !BlueprintClass->SimpleConstructionScript) { continue; }
+		for (const USCS_Node* Node : BlueprintClass->SimpleConstructionScript->GetAllNodes())
+		{
+			if (const UPrimitiveComponent* Primitive = Cast<UPrimitiveComponent>(Node->ComponentTemplate))
+			{
+				Primitives.Add(Primitive);
+			}
 		}
 	}
-	
-	// Spawn in wall meshes at each wall coordinate
-	for (const FCoordPair Location : WallLocations)
+
+	for (const UPrimitiveComponent* Primitive : Primitives)
 	{
-		SpawnWall(Location);
+		if (Primitive->IsVisible()) OutDrawCalls += FMath::Max(Primitive->GetNumMaterials(), 1);
+		if (Primitive->GetCollisionEnabled() != ECollisionEnabled::NoCollision) OutCollisionBodies++;
 	}
 }
 
-void ADungeonGenerator::SpawnWall(const FCoordPair Location)
+bool ADungeonGenerator::ApplyBudget()
+{
+	GenerationReport = BuildGenerationReport(bSpawnInstancedMeshes);
+
+	// The instanced costs are only worked out if the dungeon could switch to them and needs to
+	FString Reason;
+	FDungeonGenerationReport InstancedReport;
+	const bool bCanUseInstancedMeshes = !bSpawnInstancedMeshes && Budget.OverBudgetAction == EDungeonBudgetAction::UseInstancedMeshes &&
+		FloorMesh && WallMesh && Budget.IsExceededBy(GenerationReport, Reason);
+	if (bCanUseInstancedMeshes)
+	{
+		InstancedReport = BuildGenerationReport(true);
+	}
+
+	switch (Budget.Evaluate(GenerationReport, bCanUseInstancedMeshes ? &InstancedReport : nullptr, Reason))
+	{
+	case EDungeonBudgetResult::WithinBudget:
+		return true;
+	case EDungeonBudgetResult::UseInstancedMeshes:
+		UE_LOG(LogTemp, Warning, TEXT("Dungeon would spawn %s, switching to instanced meshes."), *Reason)
+		bSpawnInstancedMeshes = true;
+		GenerationReport = MoveTemp(InstancedReport);
+		return true;
+	default:
+		UE_LOG(LogTemp, Error, TEXT("Dungeon would spawn %s, which is over budget."), *Reason)
+		GenerationReport.bWasAborted = true;
+		return false;
+	}
+}
+
+void ADungeonGenerator::LogGenerationReport() const
+{
+	const FDungeonGenerationReport& Report = GenerationReport;
+	UE_LOG(LogTemp, Display, TEXT("Dungeon report: %d levels (%d spawned), %d rooms, %d tiles, %d walls, %d doorways, %d stairs, %.1fKB of layout"),
+		Report.NumLevels, Report.NumSpawnedLevels, Report.NumRooms, Report.NumTiles, Report.NumWalls, Report.NumDoorways, Report.NumStairs, Report.LayoutBytes / 1024.0)
+	UE_LOG(LogTemp, Display, TEXT("Dungeon report: %d actors, %d instances, ~%d draw calls, ~%d collision bodies%s"),
+		Report.NumActors, Report.NumInstances, Report.EstimatedDrawCalls, Report.EstimatedCollisionBodies, Report.bWasDowngraded ? TEXT(" (downgraded to instanced meshes)") : TEXT(""))
+	for (const TPair<TObjectPtr<UClass>, int32>& ActorCount : Report.ActorsPerClass)
+	{
+		UE_LOG(LogTemp, Display, TEXT("    %s: %d actors"), *GetNameSafe(ActorCount.Key), ActorCount.Value)
+	}
+	for (const TPair<TObjectPtr<UStaticMesh>, int32>& InstanceCount : Report.InstancesPerMesh)
+	{
+		UE_LOG(LogTemp, Display, TEXT("    %s: %d instances"), *GetNameSafe(InstanceCount.Key), InstanceCount.Value)
+	}
+}
+
+void ADungeonGenerator::RecordCsvStats() const
+{
+	const FDungeonGenerationReport& Report = GenerationReport;
+	CSV_CUSTOM_STAT(DungeonGenerator, Rooms, Report.NumRooms, ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(DungeonGenerator, Tiles, Report.NumTiles, ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(DungeonGenerator, Walls, Report.NumWalls, ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(DungeonGenerator, Doorways, Report.NumDoorways, ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(DungeonGenerator, LayoutKB, static_cast<float>(Report.LayoutBytes / 1024.0), ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(DungeonGenerator, Actors, Report.NumActors, ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(DungeonGenerator, Instances, Report.NumInstances, ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(DungeonGenerator, EstimatedDrawCalls, Report.EstimatedDrawCalls, ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(DungeonGenerator, EstimatedCollisionBodies, Report.EstimatedCollisionBodies, ECsvCustomStatOp::Set);
+}
+
+bool ADungeonGenerator::IsStairOpening(const FCoord Tile) const
+{
+	if (Tile.Z <= 0 || Tile.Z > Generation.Stairs.Num()) return false;
+	const FCoord StairTile = Generation.Stairs[Tile.Z-1].LowerTile;
+	return StairTile.X == Tile.X && StairTile.Y == Tile.Y;
+}
+
+FVector ADungeonGenerator::GetFloorLocation(const FCoord Tile) const
+{
+	return FVector(Tile.X*FloorMeshWidth, Tile.Y*FloorMeshWidth, Tile.Z*LevelHeight);
+}
+
+FTransform ADungeonGenerator::GetWallTransform(const FCoordPair Location) const
 {
 	const float X = (Location.A.X + Location.B.X)/2.f;
 	const float Y = (Location.A.Y + Location.B.Y)/2.f;
@@ -609,11 +1898,25 @@ void ADungeonGenerator::SpawnWall(const FCoordPair Location)
 		SpawnRotation = FRotator(0,90,0);
 	}
 
-	const FVector SpawnLocation = FVector(X*FloorMeshWidth, Y*FloorMeshWidth, 0);
+	const FVector SpawnLocation = FVector(X*FloorMeshWidth, Y*FloorMeshWidth, Location.A.Z*LevelHeight);
+	return FTransform(SpawnRotation, SpawnLocation);
+}
+
+void ADungeonGenerator::SpawnWall(const int Level, const FCoordPair Location)
+{
 	// Doing by spawning actors
-	AActor* NewMesh = GetWorld()->SpawnActor<AActor>(WallActor, SpawnLocation, SpawnRotation);
+	AActor* NewMesh = GetWorld()->SpawnActor<AActor>(WallActor, GetWallTransform(Location));
 	// AStaticMeshActor* NewMesh = GetWorld()->SpawnActor<AStaticMeshActor>(SpawnLocation, SpawnRotation);
 	// NewMesh->GetStaticMeshComponent()->SetStaticMesh(Mesh);
 	
-	WallActors.Push(NewMesh);
+	LevelActors[Level].WallActors.Add(Location, NewMesh);
+}
+
+void ADungeonGenerator::DestroyWall(const int Level, const FCoordPair Location)
+{
+	AActor* Mesh = nullptr;
+	if (LevelActors[Level].WallActors.RemoveAndCopyValue(Location, Mesh) && IsValid(Mesh))
+	{
+		Mesh->Destroy();
+	}
 }
@@ -4,36 +4,63 @@
 
 #include "CoreMinimal.h"
 #include "GameFramework/Actor.h"
+#include "Misc/MemStack.h"
 #include "DungeonGenerator.generated.h"
 
 
 class AStaticMeshActor;
+class UDungeonRoomShapeAsset;
+class UDungeonLayoutLibrary;
+class UInstancedStaticMeshComponent;
+class UStaticMesh;
+struct FDungeonBakedLevel;
+struct FDungeonBakedLayout;
+
+// Scratch containers used during a single generation pass. They are backed by the calling thread's FMemStack, so they
+// can only be created inside an FMemMark scope and must not outlive it. Popping the mark frees everything in one go.
+typedef TMemStackAllocator<> FDungeonScratchAllocator;
+typedef TInlineAllocator<4, FDungeonScratchAllocator> FDungeonScratchBitArrayAllocator;
+typedef TSparseArrayAllocator<FDungeonScratchAllocator, FDungeonScratchBitArrayAllocator> FDungeonScratchSparseArrayAllocator;
+typedef TSetAllocator<FDungeonScratchSparseArrayAllocator, TInlineAllocator<1, FDungeonScratchAllocator>> FDungeonScratchSetAllocator;
+
+template <typename ElementType>
+using TDungeonScratchArray = TArray<ElementType, FDungeonScratchAllocator>;
+template <typename ElementType>
+using TDungeonScratchSet = TSet<ElementType, DefaultKeyFuncs<ElementType>, FDungeonScratchSetAllocator>;
+template <typename KeyType, typename ValueType>
+using TDungeonScratchMap = TMap<KeyType, ValueType, FDungeonScratchSetAllocator>;
 
 USTRUCT()
 struct FCoord
 {
 	GENERATED_BODY()
 
-	UPROPERTY()
+	UPROPERTY(EditAnywhere)
 	int X = 0;
-	UPROPERTY()
+	UPROPERTY(EditAnywhere)
 	int Y = 0;
+	// Level of the dungeon the tile is on. Room shapes are flat, so this is only set on global coords.
+	UPROPERTY()
+	int Z = 0;
 	
 	FCoord();
 	FCoord(int InX, int InY);
+	FCoord(int InX, int InY, int InZ);
+	explicit FCoord(const FIntVector& Vector);
+	FIntVector ToIntVector() const;
 	bool operator==(const FCoord& Other) const;
 	FCoord operator+(FCoord const& obj) const;
 	bool operator<(FCoord const& C2) const;
 	static int GetManhattanDistanceBetweenCoords(FCoord A, FCoord B);
 	static float GetEuclideanDistanceBetweenCoords(FCoord A, FCoord B);
-	static TArray<FCoord> Get4AdjacentTiles(FCoord Centre);
+	static TStaticArray<FCoord, 4> Get4AdjacentTiles(FCoord Centre);
 	FCoord Inverse() const;
 };
 
 FORCEINLINE uint32 GetTypeHash(const FCoord& Coord)
 {
-	const uint32 Hash = FCrc::MemCrc32(&Coord, sizeof(FCoord));
-	return Hash;
+	// Cheaper than a CRC over the struct, and coords are hashed a lot during generation
+	return HashCombineFast(HashCombineFast(::GetTypeHash(Coord.X), ::GetTypeHash(Coord.Y)), ::GetTypeHash(Coord.Z));
 }
 
 
@@ -42,7 +69,9 @@ struct FCoordPair
 {
 	GENERATED_BODY()
 
+	UPROPERTY()
 	FCoord A;
+	UPROPERTY()
 	FCoord B;
 
 
@@ -54,8 +83,7 @@ struct FCoordPair
 
 FORCEINLINE uint32 GetTypeHash(const FCoordPair& CoordPair)
 {
-	const uint32 Hash = FCrc::MemCrc32(&CoordPair, sizeof(FCoordPair));
-	return Hash;
+	return HashCombineFast(GetTypeHash(CoordPair.A), GetTypeHash(CoordPair.B));
 }
 
 
@@ -75,9 +103,343 @@ struct FDungeonRoom
 	FDungeonRoom();
 	FDungeonRoom(FCoord InGlobalCentre, const TArray<FCoord>& InLocalCoordOffsets);
 	FDungeonRoom(FCoord InGlobalCentre, const TArray<FCoord>& InLocalCoordOffsets, int InPossibleRoomsIndex);
-	static int MaxManhattanDistanceBetweenRooms(TArray<FCoord> A, TArray<FCoord> B);
-	static bool DoRoomsOverlap(FDungeonRoom A, FDungeonRoom B);
-	static bool AreRoomsTouching(const FDungeonRoom& A, const FDungeonRoom& B);
+};
+
+
+// An edge on the outside of a room, between one of its tiles and a tile that isn't part of it
+USTRUCT()
+struct FDungeonRoomEdge
+{
+	GENERATED_BODY()
+
+	UPROPERTY()
+	FCoord Inside;
+	UPROPERTY()
+	FCoord Outside;
+};
+
+
+// One orientation of a room shape, with everything placement needs precomputed. Built once when a shape is authored
+// (or when the built-in rectangles are created) so generation never has to derive it per room.
+USTRUCT()
+struct FDungeonRoomVariant
+{
+	GENERATED_BODY()
+
+	// Tiles of the room, relative to its centre
+	UPROPERTY(VisibleAnywhere, Category="Room Variant")
+	TArray<FCoord> Tiles;
+
+	// Inclusive bounding box of Tiles
+	UPROPERTY(VisibleAnywhere, Category="Room Variant")
+	FCoord BoundsMin;
+	UPROPERTY(VisibleAnywhere, Category="Room Variant")
+	FCoord BoundsMax;
+
+	// One mask per row of the bounding box. Bit N of row R is set if tile (BoundsMin.X + N, BoundsMin.Y + R) is used
+	UPROPERTY()
+	TArray<uint64> RowMasks;
+
+	// Every edge between a tile of the room and a tile outside of it
+	UPROPERTY()
+	TArray<FDungeonRoomEdge> PerimeterEdges;
+
+	// Rooms are limited to this many tiles across, so each row of the footprint fits in a single mask
+	static constexpr int MaxWidth = 64;
+
+	// Fills in a variant from its tiles. Returns false if there are no tiles or the room is wider than MaxWidth.
+	static bool Build(const TArray<FCoord>& InTiles, FDungeonRoomVariant& OutVariant);
+	bool ContainsTile(FCoord LocalTile) const;
+	SIZE_T GetAllocatedSize() const;
+};
+
+
+// Bitmask of every used tile in a layout, one bit per tile packed along X. Lets a whole row of a room be tested
+// against the layout with a couple of word reads instead of one hash lookup per tile.
+struct FDungeonOccupancyGrid
+{
+	void Add(FCoord Tile);
+	void Remove(FCoord Tile);
+	bool Contains(FCoord Tile) const;
+
+	// True if the variant placed at Centre would cover a tile that is already used
+	bool Overlaps(const FDungeonRoomVariant& Variant, FCoord Centre) const;
+
+	SIZE_T GetAllocatedSize() const { return Words.GetAllocatedSize(); }
+
+private:
+	// Returns the 64 tiles of a row starting at column X, bit 0 being X itself
+	uint64 GetRowBits(int Y, int X) const;
+	uint64 GetWord(int Row, int Word) const;
+	void GrowToInclude(FCoord Tile);
+
+	// Row 0 is tile Y == MinY, word 0 of each row starts at tile X == MinWord * 64
+	int MinY = 0;
+	int MinWord = 0;
+	int NumRows = 0;
+	int WordsPerRow = 0;
+	TArray<uint64> Words;
+};
+
+
+// Weights used to score every position a new room could be placed at. Each score is a weighted sum of the terms below,
+// and positions are then picked with probability proportional to exp(Sharpness * Score). With everything at 0 every
+// position is equally likely.
+USTRUCT(BlueprintType)
+struct FDungeonPlacementWeights
+{
+	GENERATED_BODY()
+
+	// Per tile of distance from the origin. Negative keeps the dungeon compact, positive makes it sprawl outwards
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Placement")
+	float DistanceToOrigin = 0.f;
+
+	// Per existing room the new room would touch. Positive gives more doorways and loops, negative gives long branches
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Placement")
+	float TouchingRooms = 0.f;
+
+	// Per tile of area the layout's bounding box would grow by. Negative fills in gaps before expanding
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Placement")
+	float BoundsGrowth = 0.f;
+
+	// How strictly the scores are followed. 0 ignores them completely, large values almost always pick the best
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Placement", meta=(ClampMin="0"))
+	float Sharpness = 1.f;
+
+	bool operator==(const FDungeonPlacementWeights& Other) const
+	{
+		return DistanceToOrigin == Other.DistanceToOrigin && TouchingRooms == Other.TouchingRooms &&
+			BoundsGrowth == Other.BoundsGrowth && Sharpness == Other.Sharpness;
+	}
+};
+
+
+// The room layout of one level of the dungeon, along with the room catalogue it was built from so more rooms can be
+// added to it later
+struct FDungeonLayout
+{
+	// Room variants that can be placed in this layout. Shared by every level, owned by the generator.
+	TArrayView<const FDungeonRoomVariant> PossibleRooms;
+	// Seed of the generation this layout belongs to, each room's random stream is derived from it
+	int32 Seed = 0;
+	// Which level this is, used as the Z of every room in it
+	int Level = 0;
+	// Placed rooms, in the order they were placed
+	TArray<FDungeonRoom> Rooms;
+	// Maps every used tile to the index of the room it belongs to
+	TMap<FCoord, int> TileOwners;
+	// Same tiles as TileOwners, packed for fast overlap tests
+	FDungeonOccupancyGrid Occupancy;
+
+	// Places a variant from PossibleRooms and returns the new room's index
+	int AddRoom(FCoord GlobalCentre, int PossibleRoomsIndex);
+	void RemoveLastRoom();
+
+	SIZE_T GetAllocatedSize() const;
+};
+
+
+// A stair from one level to the one above it. Both ends are decided before any level is generated, so the levels
+// can then be generated independently of each other.
+struct FDungeonStair
+{
+	// Tile the stair stands on, on the lower level. The level above has an opening over the same X and Y.
+	FCoord LowerTile;
+	// Rooms at each end of the stair, on LowerTile.Z and the level above it. These are the room graph's links between
+	// levels.
+	int LowerRoomIndex = INDEX_NONE;
+	int UpperRoomIndex = INDEX_NONE;
+};
+
+
+// Everything one generation produces before any meshes are spawned. The levels' PossibleRooms point into RoomVariants,
+// so a generation can be moved but not copied.
+struct FDungeonGeneration
+{
+	int32 Seed = 0;
+	TArray<FDungeonRoomVariant> RoomVariants;
+	TArray<FDungeonLayout> Levels;
+	TArray<FDungeonStair> Stairs;
+
+	FDungeonGeneration() = default;
+	FDungeonGeneration(FDungeonGeneration&&) = default;
+	FDungeonGeneration& operator=(FDungeonGeneration&&) = default;
+
+	SIZE_T GetAllocatedSize() const;
+};
+
+
+// Actors spawned for one level of the dungeon
+USTRUCT()
+struct FDungeonLevelActors
+{
+	GENERATED_BODY()
+
+	// False while the level is streamed out. Its layout is kept, but none of its actors exist.
+	UPROPERTY()
+	bool bIsSpawned = false;
+
+	// Floor tiles, in the same order as the rooms and their LocalCoordOffsets in the level's layout. Tiles left open
+	// for a stair from the level below have no actor.
+	UPROPERTY()
+	TArray<AActor*> FloorActors;
+	UPROPERTY()
+	TMap<FCoordPair, AActor*> WallActors;
+	// Stairs up to the next level
+	UPROPERTY()
+	TArray<AActor*> StairActors;
+	// Actors of maps saved before dungeons had levels that don't fit the lists above, only kept so they are destroyed
+	// with the level
+	UPROPERTY()
+	TArray<AActor*> LegacyActors;
+
+	// Floors and walls of the level when they are drawn as instances instead of actors
+	UPROPERTY()
+	TObjectPtr<UInstancedStaticMeshComponent> FloorInstances;
+	UPROPERTY()
+	TObjectPtr<UInstancedStaticMeshComponent> WallInstances;
+};
+
+
+// What one level's layout contains. Worked out whenever the level changes, so building a report doesn't have to
+// flatten every level again.
+struct FDungeonLevelCounts
+{
+	int32 NumRooms = 0;
+	int32 NumTiles = 0;
+	// Tiles that get a floor, which is every tile but the opening for a stair from the level below
+	int32 NumFloors = 0;
+	int32 NumWalls = 0;
+	int32 NumDoorways = 0;
+	// Memory held by the level in the spawned baked layout, if there is one
+	int64 BakedLayoutBytes = 0;
+};
+
+
+// What a generated dungeon contains and what spawning it costs. Layout counts cover every level, spawn costs only the
+// levels that are streamed in.
+USTRUCT(BlueprintType)
+struct FDungeonGenerationReport
+{
+	GENERATED_BODY()
+
+	UPROPERTY(VisibleInstanceOnly, BlueprintReadOnly, Category="Generation Report")
+	int32 NumLevels = 0;
+	UPROPERTY(VisibleInstanceOnly, BlueprintReadOnly, Category="Generation Report")
+	int32 NumSpawnedLevels = 0;
+	UPROPERTY(VisibleInstanceOnly, BlueprintReadOnly, Category="Generation Report")
+	int32 NumRooms = 0;
+	UPROPERTY(VisibleInstanceOnly, BlueprintReadOnly, Category="Generation Report")
+	int32 NumTiles = 0;
+	UPROPERTY(VisibleInstanceOnly, BlueprintReadOnly, Category="Generation Report")
+	int32 NumWalls = 0;
+	UPROPERTY(VisibleInstanceOnly, BlueprintReadOnly, Category="Generation Report")
+	int32 NumDoorways = 0;
+	UPROPERTY(VisibleInstanceOnly, BlueprintReadOnly, Category="Generation Report")
+	int32 NumStairs = 0;
+
+	// Memory held by the generated layout (or the baked one it was spawned from), not counting the spawned meshes
+	UPROPERTY(VisibleInstanceOnly, BlueprintReadOnly, Category="Generation Report")
+	int64 LayoutBytes = 0;
+
+	UPROPERTY(VisibleInstanceOnly, BlueprintReadOnly, Category="Generation Report")
+	TMap<TObjectPtr<UClass>, int32> ActorsPerClass;
+	UPROPERTY(VisibleInstanceOnly, BlueprintReadOnly, Category="Generation Report")
+	TMap<TObjectPtr<UStaticMesh>, int32> InstancesPerMesh;
+	UPROPERTY(VisibleInstanceOnly, BlueprintReadOnly, Category="Generation Report")
+	int32 NumActors = 0;
+	UPROPERTY(VisibleInstanceOnly, BlueprintReadOnly, Category="Generation Report")
+	int32 NumInstances = 0;
+
+	// One per material of every visible mesh. An upper bound, as it ignores culling and automatic instancing.
+	UPROPERTY(VisibleInstanceOnly, BlueprintReadOnly, Category="Generation Report")
+	int32 EstimatedDrawCalls = 0;
+	// One per colliding component of every actor, and one per instance of a mesh with collision
+	UPROPERTY(VisibleInstanceOnly, BlueprintReadOnly, Category="Generation Report")
+	int32 EstimatedCollisionBodies = 0;
+
+	UPROPERTY(VisibleInstanceOnly, BlueprintReadOnly, Category="Generation Report")
+	bool bUsedInstancedMeshes = false;
+	// Switched to instanced meshes to stay within the budget
+	UPROPERTY(VisibleInstanceOnly, BlueprintReadOnly, Category="Generation Report")
+	bool bWasDowngraded = false;
+	// Over budget, so the dungeon wasn't spawned, or the last change to it (growing or streaming levels in) was refused
+	UPROPERTY(VisibleInstanceOnly, BlueprintReadOnly, Category="Generation Report")
+	bool bWasAborted = false;
+};
+
+
+// What to do when a dungeon would go over its budget
+UENUM(BlueprintType)
+enum class EDungeonBudgetAction : uint8
+{
+	// Spawn nothing
+	Abort,
+	// Draw floors and walls as instances instead, if FloorMesh and WallMesh are set and that fits. Otherwise abort.
+	UseInstancedMeshes,
+};
+
+
+// What the budget allows a dungeon to do
+enum class EDungeonBudgetResult : uint8
+{
+	WithinBudget,
+	// Over budget as it is, but fits with floors and walls drawn as instances
+	UseInstancedMeshes,
+	Abort,
+};
+
+
+// Hard limits on a dungeon, checked against its report before anything is spawned. 0 means no limit.
+USTRUCT(BlueprintType)
+struct FDungeonBudget
+{
+	GENERATED_BODY()
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Budget", meta=(ClampMin="0"))
+	int32 MaxActors = 0;
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Budget", meta=(ClampMin="0"))
+	int32 MaxInstances = 0;
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Budget", meta=(ClampMin="0"))
+	int32 MaxDrawCalls = 0;
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Budget", meta=(ClampMin="0"))
+	int32 MaxCollisionBodies = 0;
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Budget", meta=(ClampMin="0"))
+	int32 MaxLayoutKilobytes = 0;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Budget")
+	EDungeonBudgetAction OverBudgetAction = EDungeonBudgetAction::UseInstancedMeshes;
+
+	// True if the report goes over any limit, with the first one it goes over written to OutReason
+	bool IsExceededBy(const FDungeonGenerationReport& Report, FString& OutReason) const;
+
+	// Decides what happens to a dungeon that costs Report to spawn. InstancedReport is what it would cost with its
+	// floors and walls drawn as instances, or nullptr if it can't switch to them. OutReason is set if Report is over.
+	EDungeonBudgetResult Evaluate(const FDungeonGenerationReport& Report, const FDungeonGenerationReport* InstancedReport, FString& OutReason) const;
+};
+
+
+// Scoring terms that cost a pass over every tile of every candidate, so they are only worked out when asked for.
+// DistanceToOrigin is cheap and always filled in.
+enum class EDungeonCandidateTerms : uint8
+{
+	None = 0,
+	TouchingRooms = 1 << 0,
+	BoundsGrowth = 1 << 1,
+};
+ENUM_CLASS_FLAGS(EDungeonCandidateTerms)
+
+
+// Every candidate position for one room, stored as structure-of-arrays so the scoring pass is a flat loop over
+// contiguous floats. Backed by scratch memory, so it only lives as long as the room placement that built it.
+struct FDungeonCandidateBatch
+{
+	TDungeonScratchArray<FCoord> Locations;
+	TDungeonScratchArray<float> DistanceToOrigin;
+	TDungeonScratchArray<float> TouchingRooms;
+	TDungeonScratchArray<float> BoundsGrowth;
+
+	int Num() const { return Locations.Num(); }
 };
 
 
@@ -95,38 +457,180 @@ public:
 protected:
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
+
+	// Moves actors saved before LevelActors existed into it
+	virtual void PostLoad() override;
 	
-	// Actually generates the dungeon. Can be called either from the editor or during gameplay 
-	UFUNCTION(CallInEditor, Category="Dungeon Generator")
-	void GenerateDungeon();
+#if WITH_EDITOR
+	virtual void PreEditChange(FProperty* PropertyAboutToChange) override;
+	// Changing the room count or tile size of an existing dungeon only updates the parts that changed
+	virtual void PostEditChangeProperty(FPropertyChangedEvent& PropertyChangedEvent) override;
+#endif
+
+#if WITH_EDITOR
+	// Generates a layout for every seed and room count in the bake settings and stores them all in LayoutLibrary.
+	// Uses the current room shapes, placement weights and number of levels. The spawned dungeon is left as it is.
+	UFUNCTION(CallInEditor, Category="Layout Library")
+	void BakeLayoutLibrary();
+#endif
 
 	// If a dungeon has been generated, this clears the meshes so it can be re-generated
 	void ClearDungeon();
 	
-	// Generates and spawns a layout, takes the number of rooms as an input parameter
+	// Generates and spawns a layout, takes the number of rooms on each level as an input parameter
 	void GenerateLayout(int NumRooms);
 
-	// TArray<TArray<FCoord>> PossibleRooms;
-	TArray<TArray<FCoord>> InitPossibleRooms() const;
+	// Spawns a layout from LayoutLibrary matching the current settings, without generating anything.
+	// Returns false if the library has no such layout, or it is over budget.
+	bool SpawnBakedLayout();
+
+	// Hash of every setting that changes the generated layout, other than the seed and the room and level counts.
+	// Baked layouts are only used while it matches the one they were baked with.
+	uint32 GetLayoutSettingsHash() const;
+
+	// The baked layout that is currently spawned, or nullptr if the dungeon was generated
+	const FDungeonBakedLayout* GetSpawnedBakedLayout() const;
+
+	// Fills in Generation.Stairs from a baked layout, the only part of the generation spawning a baked layout needs
+	void InitBakedStairs(const FDungeonBakedLayout& BakedLayout);
+
+	// True if the layout of every level in LevelActors is known, from Generation or the spawned baked layout, and
+	// LevelCounts is up to date with it
+	bool HasSpawnedLayout() const;
 
-	// Matrix of Combinations of rooms. For each pair of rooms, contains the list of coordinates that room 2 can be
-	// placed relative to room 1 to be adjacent.
-	static TArray<FCoord> GenerateOffsetsForRooms(const TArray<FCoord>& RoomA, const TArray<FCoord>& RoomB);
-	static TArray<TArray<TArray<FCoord>>> GenerateRoomComboOffsets(TArray<TArray<FCoord>> PossibleRooms);
+	// Generation isn't saved, so a dungeon loaded with its map only has its actors. This rebuilds its layout from the
+	// spawned baked layout or by generating it again. Returns false if that isn't possible with the current settings.
+	bool RestoreSpawnedLayout();
+
+	// Flattens one level of a generation into the baked format: its rooms, and the walls and doorways left once every
+	// room has been placed
+	void BakeLevel(const FDungeonGeneration& SourceGeneration, int Level, FDungeonBakedLevel& OutLevel) const;
+
+	// Brings the last generated dungeon in line with the current NumOfRoomsToGenerate, FloorMeshWidth and LevelHeight,
+	// by appending or removing rooms at the end of each level and moving the existing meshes
+	void UpdateLayout();
+
+	// True if the cached layout was generated with the current settings, so it can be grown or shrunk in place
+	bool CanUpdateLayout() const;
+
+	// Each room gets its own random stream, so room N is placed the same way no matter how many rooms come after it
+	// or how the other levels turn out
+	FRandomStream GetRoomRandomStream(const FDungeonLayout& RoomLayout, int RoomIndex) const;
+
+	// Gathers the room variants for a generation, either from RoomShapes or, if none are set, a few built-in rectangles
+	TArray<FDungeonRoomVariant> InitPossibleRooms(FRandomStream& RandomStream) const;
+
+	// Picks where the stairs between each pair of levels go. They all sit in the starting room, which is the same on
+	// every level, so every level is connected no matter how the rest of it is generated.
+	void InitStairs(FDungeonGeneration& NewGeneration) const;
+
+	// Places rooms on a level until it has NumRooms, or no more rooms fit. Only touches the given layout, so
+	// different levels can be filled in on different threads.
+	void FillLayout(FDungeonLayout& RoomLayout, int NumRooms) const;
 
 	// Final room layout, is a list of FDungeonRooms which should all be touching each other.
-	// TSet<FCoord> RoomLayoutUsedCoords = {};
-	void AddSingleRoomToLayout(TArray<TArray<TArray<FCoord>>> RoomComboOffsets, TArray<TArray<FCoord>> PossibleRooms, TArray<FDungeonRoom> &RoomLayout, TSet<FCoord> &RoomLayoutUsedCoords) const;
+	// Returns false if no room in PossibleRooms fits anywhere around the current layout.
+	bool AddSingleRoomToLayout(FDungeonLayout& RoomLayout, FRandomStream& RandomStream) const;
+
+	// Scoring terms BuildCandidateBatch fills in, the rest are left at 0. By default only the terms with a non-zero
+	// weight in PlacementWeights, so an override of ScoreCandidates that uses other terms should override this too.
+	virtual EDungeonCandidateTerms GetRequiredCandidateTerms() const;
+
+	// Fills in the scoring terms for every candidate location of the given variant
+	void BuildCandidateBatch(const FDungeonRoomVariant& NewRoom, const FDungeonLayout& RoomLayout, FDungeonCandidateBatch& Candidates) const;
+
+	// Scoring stage for room placement, writes one score per candidate. Override to give a dungeon a different shape.
+	// Levels are generated in parallel, so overrides must be safe to call from several threads at once.
+	virtual void ScoreCandidates(const FDungeonCandidateBatch& Candidates, TArrayView<float> OutScores) const;
+
+	// Picks a candidate index at random, weighted by exp(Sharpness * Score)
+	int PickWeightedCandidate(TArrayView<const float> Scores, FRandomStream& RandomStream) const;
+
+	// Spawns the meshes for every level that should currently be streamed in
+	void SpawnMeshes();
+
+	// True if the level is within LevelStreamingRadius of ActiveLevel
+	bool ShouldLevelBeSpawned(int Level) const;
+
+	// Streams levels in and out around ActiveLevel. Returns false, leaving every level as it was, if the levels that
+	// would be streamed in are over budget or the dungeon's layout can't be restored.
+	bool StreamLevels();
+
+	// Spawns or destroys the meshes of a whole level. The level's layout is kept either way.
+	void SpawnLevelMeshes(int Level);
+	void DestroyLevelMeshes(int Level);
+
+	// Spawns the floor tiles of a room, and its walls with every room placed before it. Walls shared with earlier rooms
+	// already exist, so only the archway between the two rooms is removed.
+	void SpawnRoomMeshes(int Level, int RoomIndex);
+
+	// Works out how placing a room changes the walls of its level: the walls it adds on edges no earlier room has a
+	// wall on, and the archways it knocks through walls that an earlier room already has
+	void GetRoomWallChanges(const FDungeonLayout& RoomLayout, int RoomIndex, TDungeonScratchArray<FCoordPair>& OutNewWalls, TDungeonScratchArray<FCoordPair>& OutArchways) const;
+
+	// Spawns the floor tiles and walls of a baked level as actors
+	void SpawnBakedLevelActors(int Level, const FDungeonBakedLevel& BakedLevel);
+
+	// Replaces every floor and wall instance of a level in one upload each, from the baked layout or the generation
+	void RebuildLevelInstances(int Level);
+	void SetInstances(TObjectPtr<UInstancedStaticMeshComponent>& Component, UStaticMesh* Mesh, const TArray<FTransform>& Transforms);
+
+	// Counts what one level of the spawned dungeon contains
+	FDungeonLevelCounts CountLevel(int Level) const;
+
+	// Recounts every level of the spawned dungeon into LevelCounts
+	void UpdateLevelCounts();
+
+	// Adds up what the dungeon contains and what spawning its streamed in levels costs, with or without instancing.
+	// Only the spawn costs are worked out here, the layout counts come from LevelCounts.
+	FDungeonGenerationReport BuildGenerationReport(bool bInstanced) const;
 
-	void SpawnMeshes(const TArray<FDungeonRoom>& RoomLayout);
+	// Draw calls and collision bodies of one actor of the class, from its native and Blueprint component templates
+	void EstimateActorCost(TSubclassOf<AActor> ActorClass, int32& OutDrawCalls, int32& OutCollisionBodies) const;
+
+	// Refreshes GenerationReport and checks it against Budget, switching to instanced meshes if that is allowed and
+	// fits. Returns false if the dungeon is over budget and shouldn't be spawned. Only logs if it is over budget.
+	bool ApplyBudget();
+
+	// Writes GenerationReport to the log
+	void LogGenerationReport() const;
+
+	// Sets this frame's CSV profiler stats from GenerationReport
+	void RecordCsvStats() const;
+
+	// Removes the last room from a level and undoes its SpawnRoomMeshes, restoring walls that were archways into it
+	void RemoveLastRoom(int Level);
+
+	// Moves every spawned mesh to match the current FloorMeshWidth and LevelHeight
+	void UpdateMeshTransforms();
+
+	// Picks which of the walls between two rooms becomes the archway. Only depends on the seed and the two rooms.
+	FCoordPair PickArchway(const FDungeonLayout& RoomLayout, int RoomIndexA, int RoomIndexB, TArrayView<FCoordPair> ConnectingWalls) const;
+
+	// True if the tile is left open for a stair coming up from the level below
+	bool IsStairOpening(FCoord Tile) const;
+
+	FVector GetFloorLocation(FCoord Tile) const;
+	FTransform GetWallTransform(FCoordPair Location) const;
 
 	// TODO also SpawnFloor function
-	void SpawnWall(FCoordPair Location);
+	void SpawnWall(int Level, FCoordPair Location);
+	void DestroyWall(int Level, FCoordPair Location);
 
 public:	
 	// Called every frame
 	virtual void Tick(float DeltaTime) override;
 
+	// Actually generates the dungeon. Can be called either from the editor or during gameplay, where with
+	// bUseLayoutLibrary a baked layout is spawned without generating anything.
+	// If the seed is unchanged since the last generation, the existing dungeon is updated instead of rebuilt.
+	UFUNCTION(BlueprintCallable, CallInEditor, Category="Dungeon Generator")
+	void GenerateDungeon();
+
+	// Generates every level of a dungeon without spawning anything. Only writes to OutGeneration, so it can be used
+	// to build layouts other than the spawned one. Returns false if the settings can't produce a dungeon.
+	bool BuildGeneration(int32 GenerationSeed, int NumRooms, FDungeonGeneration& OutGeneration) const;
+
 
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon Actors")
 	TSubclassOf<AActor> FloorActor;
@@ -134,16 +638,153 @@ public:
 	TSubclassOf<AActor> WallActor;
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon Actors")
 	TSubclassOf<AActor> ArchwayActor;
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon Actors")
+	TSubclassOf<AActor> StairActor;
+
+	// Draws floors and walls as instances of FloorMesh and WallMesh instead of spawning an actor for each, so a whole
+	// level is uploaded in one go. Stairs are still spawned as actors.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon Actors")
+	bool bUseInstancedMeshes = false;
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon Actors", meta=(EditCondition="bUseInstancedMeshes"))
+	TObjectPtr<UStaticMesh> FloorMesh;
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon Actors", meta=(EditCondition="bUseInstancedMeshes"))
+	TObjectPtr<UStaticMesh> WallMesh;
 	
 	UPROPERTY(EditAnywhere)
 	float FloorMeshWidth = 500;
 
+	// Number of rooms on each level
 	UPROPERTY(EditAnywhere)
 	int NumOfRoomsToGenerate = 10;
 
+	// Number of levels stacked on top of each other, linked by stairs
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon Generator", meta=(ClampMin="1"))
+	int32 NumLevels = 1;
+
+	// Vertical distance between levels
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon Generator")
+	float LevelHeight = 500;
+
+	// Only levels this close to ActiveLevel have their actors spawned. -1 keeps every level spawned.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon Generator", meta=(ClampMin="-1"))
+	int32 LevelStreamingRadius = -1;
+
+	// Seed for the whole dungeon. The same seed and settings always give the same dungeon.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon Generator")
+	int32 Seed = 0;
+
+	// Picks a new seed every time GenerateDungeon is called. Turn off to iterate on a single dungeon.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon Generator")
+	bool bRandomiseSeed = true;
+
+	// Room shapes to build the dungeon from. Every rotation and reflection allowed by each shape is used.
+	// If empty, a few small rectangular rooms are used instead.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon Generator")
+	TArray<TObjectPtr<UDungeonRoomShapeAsset>> RoomShapes;
+
+	// Limits each generation to a random subset of this many room variants. 0 uses all of them.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon Generator", meta=(ClampMin="0"))
+	int32 MaxRoomVariantsInGeneration = 0;
+
+	// Controls where new rooms are placed, e.g. compact vs. sprawling dungeons
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon Generator")
+	FDungeonPlacementWeights PlacementWeights;
+
+	// Layouts baked ahead of time with BakeLayoutLibrary
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Layout Library")
+	TObjectPtr<UDungeonLayoutLibrary> LayoutLibrary;
+
+	// GenerateDungeon spawns a layout from LayoutLibrary with the same number of levels and rooms instead of
+	// generating one. Falls back to generating if the library has none.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Layout Library")
+	bool bUseLayoutLibrary = false;
+
+	// BakeLayoutLibrary bakes BakeNumSeeds seeds, starting from this one
+	UPROPERTY(EditAnywhere, Category="Layout Library")
+	int32 BakeFirstSeed = 0;
+	UPROPERTY(EditAnywhere, Category="Layout Library", meta=(ClampMin="1"))
+	int32 BakeNumSeeds = 16;
+
+	// Rooms per level to bake every seed with. Empty bakes NumOfRoomsToGenerate only.
+	UPROPERTY(EditAnywhere, Category="Layout Library")
+	TArray<int32> BakeRoomCounts;
+
+	// Level the player is on. Levels are streamed in and out around it.
+	UFUNCTION(BlueprintCallable, Category="Dungeon Generator")
+	void SetActiveLevel(int32 Level);
+
+	UFUNCTION(BlueprintPure, Category="Dungeon Generator")
+	int32 GetActiveLevel() const { return ActiveLevel; }
+
+	// Limits on what a dungeon may spawn, checked every time it is generated or grown
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Budget")
+	FDungeonBudget Budget;
+
+	// Report for the current dungeon, updated whenever it is generated, updated or streamed
+	UFUNCTION(BlueprintPure, Category="Budget")
+	const FDungeonGenerationReport& GetGenerationReport() const { return GenerationReport; }
+
+	// Actors spawned for each level of the dungeon
 	UPROPERTY()
-	TArray<AActor*> FloorActors;
+	TArray<FDungeonLevelActors> LevelActors;
+
+	// Floor and wall actors of maps saved before dungeons had levels. Moved into level 0 of LevelActors on load.
+	UPROPERTY(meta=(DeprecatedProperty, DeprecationMessage="Use LevelActors instead"))
+	TArray<AActor*> FloorActors_DEPRECATED;
+	UPROPERTY(meta=(DeprecatedProperty, DeprecationMessage="Use LevelActors instead"))
+	TArray<AActor*> WallActors_DEPRECATED;
+
+private:
+	UPROPERTY(VisibleInstanceOnly, Category="Dungeon Generator")
+	int32 ActiveLevel = 0;
+
+	UPROPERTY(VisibleInstanceOnly, Category="Budget")
+	FDungeonGenerationReport GenerationReport;
+
+	// Whether floors and walls are actually spawned as instances. Starts as bUseInstancedMeshes, but can be switched
+	// on to stay within the budget. Saved so levels streamed in after loading match the ones saved with the map.
+	UPROPERTY()
+	bool bSpawnInstancedMeshes = false;
+
+#if WITH_EDITORONLY_DATA
+	// LevelStreamingRadius before it was edited, to go back to if the new radius streams in too much
+	int32 PreEditLevelStreamingRadius = -1;
+#endif
+
+	// State of the last generation, kept around so the dungeon can be updated in place. Not saved, see
+	// RestoreSpawnedLayout. Only the stairs are set when a baked layout is spawned.
+	FDungeonGeneration Generation;
+
+	// What each level of the spawned dungeon contains, see CountLevel. Empty while the layout isn't known.
+	TArray<FDungeonLevelCounts> LevelCounts;
+
+	// Library and index of the spawned baked layout, if the dungeon came from one
+	UPROPERTY()
+	TObjectPtr<UDungeonLayoutLibrary> SpawnedLayoutLibrary;
+	UPROPERTY()
+	int32 SpawnedBakedLayoutIndex = INDEX_NONE;
+
+	// Seed, rooms per level and GetLayoutSettingsHash of the spawned dungeon, saved so its layout can be rebuilt
+	UPROPERTY()
+	int32 SpawnedSeed = 0;
+	UPROPERTY()
+	int32 SpawnedNumRooms = 0;
 	UPROPERTY()
-	TArray<AActor*> WallActors;
+	uint32 SpawnedSettingsHash = 0;
+
+	bool bHasCachedLayout = false;
+	int32 CachedSeed = 0;
+	float CachedFloorMeshWidth = 0.f;
+	float CachedLevelHeight = 0.f;
+	int32 CachedNumLevels = 0;
+	FDungeonPlacementWeights CachedPlacementWeights;
+	TSubclassOf<AActor> CachedFloorActor;
+	TSubclassOf<AActor> CachedWallActor;
+	TSubclassOf<AActor> CachedStairActor;
+	bool bCachedUseInstancedMeshes = false;
+	TObjectPtr<UStaticMesh> CachedFloorMesh;
+	TObjectPtr<UStaticMesh> CachedWallMesh;
+	TArray<TObjectPtr<UDungeonRoomShapeAsset>> CachedRoomShapes;
+	int32 CachedMaxRoomVariantsInGeneration = 0;
 
 };
@@ -0,0 +1,68 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "DungeonLayoutLibrary.h"
+
+#include "Serialization/CustomVersion.h"
+
+
+// Version of the FDungeonBakedLevel format. Add a new entry above VersionPlusOne whenever the format changes.
+struct FDungeonLayoutLibraryVersion
+{
+	enum Type
+	{
+		// Rooms, walls and the number of doorways, each bulk serialized
+		InitialVersion = 0,
+
+		VersionPlusOne,
+		LatestVersion = VersionPlusOne - 1
+	};
+
+	static const FGuid GUID;
+};
+
+const FGuid FDungeonLayoutLibraryVersion::GUID(0x6A1C3F52, 0x9B0E4D27, 0xA5E8317C, 0x2F4B9D61);
+FCustomVersionRegistration GRegisterDungeonLayoutLibraryVersion(FDungeonLayoutLibraryVersion::GUID, FDungeonLayoutLibraryVersion::LatestVersion, TEXT("DungeonLayoutLibraryVer"));
+
+
+bool FDungeonBakedLevel::Serialize(FArchive& Ar)
+{
+	Ar.UsingCustomVersion(FDungeonLayoutLibraryVersion::GUID);
+	const int32 Version = Ar.CustomVer(FDungeonLayoutLibraryVersion::GUID);
+	if (Ar.IsLoading() && Version > FDungeonLayoutLibraryVersion::LatestVersion)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Baked dungeon level was saved with a newer format (%d, this build reads up to %d), so it can't be loaded."), Version, static_cast<int32>(FDungeonLayoutLibraryVersion::LatestVersion))
+		Ar.SetError();
+		return true;
+	}
+
+	RoomCentres.BulkSerialize(Ar);
+	RoomTileCounts.BulkSerialize(Ar);
+	RoomTiles.BulkSerialize(Ar);
+	Walls.BulkSerialize(Ar);
+	Ar << NumDoorways;
+	return true;
+}
+
+SIZE_T FDungeonBakedLevel::GetAllocatedSize() const
+{
+	return RoomCentres.GetAllocatedSize() + RoomTileCounts.GetAllocatedSize() + RoomTiles.GetAllocatedSize() +
+		Walls.GetAllocatedSize();
+}
+
+
+int UDungeonLayoutLibrary::PickLayout(const int NumRooms, const int NumLevels, const uint32 SettingsHash, const int32 Seed, FRandomStream& RandomStream) const
+{
+	TArray<int, TInlineAllocator<64>> Matches;
+	for (int i = 0; i < Layouts.Num(); i++)
+	{
+		const FDungeonBakedLayout& Layout = Layouts[i];
+		if (Layout.NumRooms != NumRooms || Layout.Levels.Num() != NumLevels || Layout.SettingsHash != SettingsHash) { continue; }
+
+		if (Layout.Seed == Seed) return i;
+		Matches.Add(i);
+	}
+
+	if (Matches.IsEmpty()) return INDEX_NONE;
+	return Matches[RandomStream.RandRange(0, Matches.Num()-1)];
+}
@@ -0,0 +1,88 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Engine/DataAsset.h"
+#include "DungeonLayoutLibrary.generated.h"
+
+/**
+ * One level of a baked layout. Everything is stored as flat arrays of plain data, which are saved and loaded as single
+ * blocks rather than property by property.
+ */
+USTRUCT()
+struct FDungeonBakedLevel
+{
+	GENERATED_BODY()
+
+	// Centre of each room, in the order the rooms were placed
+	TArray<FIntVector> RoomCentres;
+	// Number of tiles in each room. The tiles of every room follow each other in RoomTiles.
+	TArray<int32> RoomTileCounts;
+	TArray<FIntVector> RoomTiles;
+
+	// Two tiles per wall, one on each side of it
+	TArray<FIntVector> Walls;
+	// Archways between rooms. They are just gaps in the walls, so only the count is kept.
+	int32 NumDoorways = 0;
+
+	bool Serialize(FArchive& Ar);
+	SIZE_T GetAllocatedSize() const;
+};
+
+template<>
+struct TStructOpsTypeTraits<FDungeonBakedLevel> : public TStructOpsTypeTraitsBase2<FDungeonBakedLevel>
+{
+	enum
+	{
+		WithSerializer = true,
+	};
+};
+
+
+// A whole dungeon baked from one seed
+USTRUCT()
+struct FDungeonBakedLayout
+{
+	GENERATED_BODY()
+
+	UPROPERTY(VisibleAnywhere, Category="Baked Layout")
+	int32 Seed = 0;
+
+	// Rooms per level the layout was generated with. Levels that ran out of space have fewer.
+	UPROPERTY(VisibleAnywhere, Category="Baked Layout")
+	int32 NumRooms = 0;
+
+	// Hash of the generator settings the layout was baked with, see ADungeonGenerator::GetLayoutSettingsHash
+	UPROPERTY(VisibleAnywhere, Category="Baked Layout")
+	uint32 SettingsHash = 0;
+
+	UPROPERTY()
+	TArray<FDungeonBakedLevel> Levels;
+
+	// Tile each stair stands on, one per pair of levels
+	UPROPERTY()
+	TArray<FIntVector> Stairs;
+	// Room at the bottom (X) and top (Y) of each stair
+	UPROPERTY()
+	TArray<FIntPoint> StairRooms;
+};
+
+
+/**
+ * Dungeon layouts baked ahead of time by ADungeonGenerator::BakeLayoutLibrary, so a dungeon can be spawned at runtime
+ * straight from the loaded asset without running any of the generator.
+ */
+UCLASS(BlueprintType)
+class DUNGEONRPG_API UDungeonLayoutLibrary : public UPrimaryDataAsset
+{
+	GENERATED_BODY()
+
+public:
+	UPROPERTY(VisibleAnywhere, Category="Layout Library")
+	TArray<FDungeonBakedLayout> Layouts;
+
+	// Returns the index of a layout with the given rooms per level and number of levels, baked with the given settings,
+	// or INDEX_NONE if there isn't one. A layout baked from Seed is preferred, otherwise one is picked with RandomStream.
+	int PickLayout(int NumRooms, int NumLevels, uint32 SettingsHash, int32 Seed, FRandomStream& RandomStream) const;
+};
@@ -0,0 +1,108 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "DungeonRoomShapeAsset.h"
+
+#include "Algo/Sort.h"
+
+
+void UDungeonRoomShapeAsset::RebuildVariants()
+{
+	Variants.Empty();
+
+	if (!HasValidTiles())
+	{
+		UE_LOG(LogTemp, Error, TEXT("Room shape %s is empty or has tiles that aren't connected to the rest, so it can't be used."), *GetName())
+		return;
+	}
+
+	// Shapes already added, moved so their bounding box starts at 0,0 and sorted, to spot orientations that are
+	// identical (e.g. every rotation of a square)
+	TArray<TArray<FCoord>> SeenShapes;
+
+	const int NumRotations = bAllowRotations ? 4 : 1;
+	const int NumReflections = bAllowReflections ? 2 : 1;
+	for (int Reflection = 0; Reflection < NumReflections; Reflection++)
+	{
+		for (int Rotation = 0; Rotation < NumRotations; Rotation++)
+		{
+			TArray<FCoord> OrientedTiles;
+			OrientedTiles.Reserve(Tiles.Num());
+			for (const FCoord Tile : Tiles)
+			{
+				FCoord OrientedTile = Reflection ? FCoord(-Tile.X, Tile.Y) : Tile;
+				for (int i = 0; i < Rotation; i++)
+				{
+					OrientedTile = FCoord(-OrientedTile.Y, OrientedTile.X);
+				}
+				OrientedTiles.AddUnique(OrientedTile);
+			}
+
+			FDungeonRoomVariant Variant;
+			if (!FDungeonRoomVariant::Build(OrientedTiles, Variant))
+			{
+				UE_LOG(LogTemp, Error, TEXT("Room shape %s is empty or wider than %d tiles, so it can't be used."), *GetName(), FDungeonRoomVariant::MaxWidth)
+				Variants.Empty();
+				return;
+			}
+
+			TArray<FCoord> NormalisedTiles;
+			NormalisedTiles.Reserve(OrientedTiles.Num());
+			for (const FCoord Tile : OrientedTiles)
+			{
+				NormalisedTiles.Add(Tile + Variant.BoundsMin.Inverse());
+			}
+			Algo::Sort(NormalisedTiles, [](const FCoord& Item1, const FCoord& Item2)
+			{
+				return Item1.Y != Item2.Y ? Item1.Y < Item2.Y : Item1.X < Item2.X;
+			});
+			if (SeenShapes.Contains(NormalisedTiles)) { continue; }
+
+			SeenShapes.Add(MoveTemp(NormalisedTiles));
+			Variants.Add(MoveTemp(Variant));
+		}
+	}
+}
+
+bool UDungeonRoomShapeAsset::HasValidTiles() const
+{
+	if (Tiles.IsEmpty()) return false;
+
+	// Flood fill from the first tile, every tile should be reached
+	TSet<FCoord> TileSet(Tiles);
+	TSet<FCoord> Reached;
+	TArray<FCoord> ToVisit;
+	ToVisit.Add(Tiles[0]);
+	Reached.Add(Tiles[0]);
+	while (!ToVisit.IsEmpty())
+	{
+		const FCoord Tile = ToVisit.Pop();
+		for (const FCoord AdjacentTile : FCoord::Get4AdjacentTiles(Tile))
+		{
+			if (!TileSet.Contains(AdjacentTile) || Reached.Contains(AdjacentTile)) { continue; }
+			Reached.Add(AdjacentTile);
+			ToVisit.Add(AdjacentTile);
+		}
+	}
+	return Reached.Num() == TileSet.Num();
+}
+
+void UDungeonRoomShapeAsset::PostLoad()
+{
+	Super::PostLoad();
+
+	// Assets saved before the variants were stored with them, or before shapes were checked
+	if (Variants.IsEmpty() || !HasValidTiles())
+	{
+		RebuildVariants();
+	}
+}
+
+#if WITH_EDITOR
+void UDungeonRoomShapeAsset::PostEditChangeProperty(FPropertyChangedEvent& PropertyChangedEvent)
+{
+	Super::PostEditChangeProperty(PropertyChangedEvent);
+
+	RebuildVariants();
+}
+#endif
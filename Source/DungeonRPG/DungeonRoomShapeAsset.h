@@ -0,0 +1,47 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DungeonGenerator.h"
+#include "Engine/DataAsset.h"
+#include "DungeonRoomShapeAsset.generated.h"
+
+/**
+ * A room shape for the dungeon generator, made of any set of tiles (L, T, cross, irregular...).
+ * Every allowed rotation and reflection is worked out when the asset is edited and saved with it, so generation can
+ * use large catalogues of shapes without doing any of that work at runtime.
+ */
+UCLASS(BlueprintType)
+class DUNGEONRPG_API UDungeonRoomShapeAsset : public UPrimaryDataAsset
+{
+	GENERATED_BODY()
+
+public:
+	// Tiles making up the room, relative to its centre. Should all be connected to each other.
+	UPROPERTY(EditAnywhere, Category="Room Shape")
+	TArray<FCoord> Tiles;
+
+	// Also use the shape rotated by 90, 180 and 270 degrees
+	UPROPERTY(EditAnywhere, Category="Room Shape")
+	bool bAllowRotations = true;
+
+	// Also use the shape mirrored (and the mirrored shape's rotations, if those are allowed)
+	UPROPERTY(EditAnywhere, Category="Room Shape")
+	bool bAllowReflections = true;
+
+	// Every distinct orientation of Tiles. Rebuilt whenever the shape is edited.
+	UPROPERTY(VisibleAnywhere, Category="Room Shape")
+	TArray<FDungeonRoomVariant> Variants;
+
+	// Regenerates Variants from Tiles and the allowed orientations. Invalid shapes are left with no variants.
+	void RebuildVariants();
+
+	// True if the shape has at least one tile and every tile can be reached from every other one
+	bool HasValidTiles() const;
+
+	virtual void PostLoad() override;
+#if WITH_EDITOR
+	virtual void PostEditChangeProperty(FPropertyChangedEvent& PropertyChangedEvent) override;
+#endif
+};
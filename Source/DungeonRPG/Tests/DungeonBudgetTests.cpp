@@ -0,0 +1,78 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "DungeonGenerator.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FDungeonBudgetLimitsTest, "DungeonRPG.Budget.Limits",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::ProductFilter)
+
+bool FDungeonBudgetLimitsTest::RunTest(const FString& Parameters)
+{
+	FDungeonGenerationReport Report;
+	Report.NumActors = 100;
+	Report.NumInstances = 200;
+	Report.EstimatedDrawCalls = 300;
+	Report.EstimatedCollisionBodies = 400;
+	Report.LayoutBytes = 10 * 1024;
+
+	FString Reason;
+	TestFalse(TEXT("No limits set"), FDungeonBudget().IsExceededBy(Report, Reason));
+
+	// Each limit on its own, just under and just over the report
+	auto IsExceeded = [&Report, &Reason](int32 FDungeonBudget::* Limit, const int32 Value)
+	{
+		FDungeonBudget Budget;
+		Budget.*Limit = Value;
+		Reason.Reset();
+		return Budget.IsExceededBy(Report, Reason);
+	};
+	TestFalse(TEXT("Actors at the limit"), IsExceeded(&FDungeonBudget::MaxActors, 100));
+	TestTrue(TEXT("Actors over the limit"), IsExceeded(&FDungeonBudget::MaxActors, 99));
+	TestTrue(TEXT("Reason names the actors"), Reason.Contains(TEXT("100 actors")));
+	TestFalse(TEXT("Instances at the limit"), IsExceeded(&FDungeonBudget::MaxInstances, 200));
+	TestTrue(TEXT("Instances over the limit"), IsExceeded(&FDungeonBudget::MaxInstances, 199));
+	TestFalse(TEXT("Draw calls at the limit"), IsExceeded(&FDungeonBudget::MaxDrawCalls, 300));
+	TestTrue(TEXT("Draw calls over the limit"), IsExceeded(&FDungeonBudget::MaxDrawCalls, 299));
+	TestFalse(TEXT("Collision bodies at the limit"), IsExceeded(&FDungeonBudget::MaxCollisionBodies, 400));
+	TestTrue(TEXT("Collision bodies over the limit"), IsExceeded(&FDungeonBudget::MaxCollisionBodies, 399));
+	TestFalse(TEXT("Layout at the limit"), IsExceeded(&FDungeonBudget::MaxLayoutKilobytes, 10));
+	TestTrue(TEXT("Layout over the limit"), IsExceeded(&FDungeonBudget::MaxLayoutKilobytes, 9));
+	return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FDungeonBudgetEvaluateTest, "DungeonRPG.Budget.AbortOrDowngrade",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::ProductFilter)
+
+bool FDungeonBudgetEvaluateTest::RunTest(const FString& Parameters)
+{
+	FDungeonBudget Budget;
+	Budget.MaxActors = 50;
+
+	// The same dungeon spawned as actors, and with its floors and walls drawn as instances
+	FDungeonGenerationReport ActorReport;
+	ActorReport.NumActors = 100;
+	FDungeonGenerationReport InstancedReport;
+	InstancedReport.NumActors = 2;
+	InstancedReport.NumInstances = 98;
+
+	FString Reason;
+	FDungeonGenerationReport SmallReport;
+	SmallReport.NumActors = 10;
+	TestTrue(TEXT("Within budget"), Budget.Evaluate(SmallReport, &InstancedReport, Reason) == EDungeonBudgetResult::WithinBudget);
+
+	Budget.OverBudgetAction = EDungeonBudgetAction::UseInstancedMeshes;
+	TestTrue(TEXT("Over budget, instances fit"), Budget.Evaluate(ActorReport, &InstancedReport, Reason) == EDungeonBudgetResult::UseInstancedMeshes);
+	TestTrue(TEXT("Over budget, can't use instances"), Budget.Evaluate(ActorReport, nullptr, Reason) == EDungeonBudgetResult::Abort);
+
+	Budget.MaxInstances = 50;
+	TestTrue(TEXT("Over budget, instances are over too"), Budget.Evaluate(ActorReport, &InstancedReport, Reason) == EDungeonBudgetResult::Abort);
+
+	Budget.MaxInstances = 0;
+	Budget.OverBudgetAction = EDungeonBudgetAction::Abort;
+	TestTrue(TEXT("Over budget, set to abort"), Budget.Evaluate(ActorReport, &InstancedReport, Reason) == EDungeonBudgetResult::Abort);
+	return true;
+}
+
+#endif
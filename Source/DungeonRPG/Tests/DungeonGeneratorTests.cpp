@@ -0,0 +1,71 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "DungeonGenerator.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FDungeonGeneratorSameSeedTest, "DungeonRPG.DungeonGenerator.SameSeedGivesSameLayout",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::ProductFilter)
+
+bool FDungeonGeneratorSameSeedTest::RunTest(const FString& Parameters)
+{
+	ADungeonGenerator* Generator = NewObject<ADungeonGenerator>(GetTransientPackage());
+	Generator->NumLevels = 3;
+
+	// Built twice from the same seed, and once with fewer rooms, which should match the start of the full layout
+	constexpr int32 TestSeed = 1234;
+	constexpr int NumRooms = 20;
+	constexpr int NumPrefixRooms = 8;
+	FDungeonGeneration First;
+	FDungeonGeneration Second;
+	FDungeonGeneration Prefix;
+	if (!TestTrue(TEXT("First generation succeeds"), Generator->BuildGeneration(TestSeed, NumRooms, First)) ||
+		!TestTrue(TEXT("Second generation succeeds"), Generator->BuildGeneration(TestSeed, NumRooms, Second)) ||
+		!TestTrue(TEXT("Shorter generation succeeds"), Generator->BuildGeneration(TestSeed, NumPrefixRooms, Prefix)))
+	{
+		return false;
+	}
+
+	TestEqual(TEXT("Number of levels"), Second.Levels.Num(), First.Levels.Num());
+	TestEqual(TEXT("Number of stairs"), Second.Stairs.Num(), First.Stairs.Num());
+	for (int i = 0; i < FMath::Min(First.Stairs.Num(), Second.Stairs.Num()); i++)
+	{
+		TestTrue(FString::Printf(TEXT("Stair %d is on the same tile"), i), First.Stairs[i].LowerTile == Second.Stairs[i].LowerTile);
+	}
+
+	// Each stair links the rooms it stands in on the levels it joins
+	for (const FDungeonStair& Stair : First.Stairs)
+	{
+		const FCoord UpperTile(Stair.LowerTile.X, Stair.LowerTile.Y, Stair.LowerTile.Z + 1);
+		const int* LowerOwner = First.Levels[Stair.LowerTile.Z].TileOwners.Find(Stair.LowerTile);
+		const int* UpperOwner = First.Levels[UpperTile.Z].TileOwners.Find(UpperTile);
+		TestTrue(FString::Printf(TEXT("Stair from level %d starts in its lower room"), Stair.LowerTile.Z), LowerOwner && *LowerOwner == Stair.LowerRoomIndex);
+		TestTrue(FString::Printf(TEXT("Stair from level %d ends in its upper room"), Stair.LowerTile.Z), UpperOwner && *UpperOwner == Stair.UpperRoomIndex);
+	}
+
+	for (int Level = 0; Level < FMath::Min(First.Levels.Num(), Second.Levels.Num()); Level++)
+	{
+		const TArray<FDungeonRoom>& FirstRooms = First.Levels[Level].Rooms;
+		const TArray<FDungeonRoom>& SecondRooms = Second.Levels[Level].Rooms;
+		const TArray<FDungeonRoom>& PrefixRooms = Prefix.Levels[Level].Rooms;
+		TestEqual(FString::Printf(TEXT("Number of rooms on level %d"), Level), SecondRooms.Num(), FirstRooms.Num());
+
+		for (int RoomIndex = 0; RoomIndex < FMath::Min(FirstRooms.Num(), SecondRooms.Num()); RoomIndex++)
+		{
+			TestTrue(FString::Printf(TEXT("Room %d on level %d is in the same place"), RoomIndex, Level),
+				FirstRooms[RoomIndex].GlobalCentre == SecondRooms[RoomIndex].GlobalCentre);
+			TestEqual(FString::Printf(TEXT("Room %d on level %d has the same shape"), RoomIndex, Level),
+				SecondRooms[RoomIndex].PossibleRoomsIndex, FirstRooms[RoomIndex].PossibleRoomsIndex);
+		}
+		for (int RoomIndex = 0; RoomIndex < FMath::Min(FirstRooms.Num(), PrefixRooms.Num()); RoomIndex++)
+		{
+			TestTrue(FString::Printf(TEXT("Room %d on level %d doesn't depend on later rooms"), RoomIndex, Level),
+				FirstRooms[RoomIndex].GlobalCentre == PrefixRooms[RoomIndex].GlobalCentre &&
+				FirstRooms[RoomIndex].PossibleRoomsIndex == PrefixRooms[RoomIndex].PossibleRoomsIndex);
+		}
+	}
+	return true;
+}
+
+#endif
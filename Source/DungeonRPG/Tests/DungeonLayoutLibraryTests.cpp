@@ -0,0 +1,43 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "DungeonLayoutLibrary.h"
+#include "Misc/AutomationTest.h"
+#include "Serialization/MemoryReader.h"
+#include "Serialization/MemoryWriter.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FDungeonBakedLevelRoundTripTest, "DungeonRPG.LayoutLibrary.BakedLevelRoundTrip",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::ProductFilter)
+
+bool FDungeonBakedLevelRoundTripTest::RunTest(const FString& Parameters)
+{
+	// Two rooms, a 2x1 one and a single tile next to it, with a doorway between them
+	FDungeonBakedLevel Level;
+	Level.RoomCentres = { FIntVector(0, 0, 1), FIntVector(2, 0, 1) };
+	Level.RoomTileCounts = { 2, 1 };
+	Level.RoomTiles = { FIntVector(0, 0, 1), FIntVector(1, 0, 1), FIntVector(2, 0, 1) };
+	Level.Walls = { FIntVector(0, 0, 1), FIntVector(0, 1, 1), FIntVector(2, 0, 1), FIntVector(3, 0, 1) };
+	Level.NumDoorways = 1;
+
+	TArray<uint8> Bytes;
+	FMemoryWriter Writer(Bytes);
+	Level.Serialize(Writer);
+
+	// A package keeps the custom versions it was saved with, so the reader gets them the same way
+	FDungeonBakedLevel LoadedLevel;
+	FMemoryReader Reader(Bytes);
+	Reader.SetCustomVersions(Writer.GetCustomVersions());
+	LoadedLevel.Serialize(Reader);
+
+	TestFalse(TEXT("Loading succeeds"), Reader.IsError());
+	TestTrue(TEXT("Every byte is read back"), Reader.AtEnd());
+	TestTrue(TEXT("Room centres"), LoadedLevel.RoomCentres == Level.RoomCentres);
+	TestTrue(TEXT("Room tile counts"), LoadedLevel.RoomTileCounts == Level.RoomTileCounts);
+	TestTrue(TEXT("Room tiles"), LoadedLevel.RoomTiles == Level.RoomTiles);
+	TestTrue(TEXT("Walls"), LoadedLevel.Walls == Level.Walls);
+	TestEqual(TEXT("Number of doorways"), LoadedLevel.NumDoorways, Level.NumDoorways);
+	return true;
+}
+
+#endif
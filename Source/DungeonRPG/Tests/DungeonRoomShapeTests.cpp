@@ -0,0 +1,67 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "DungeonRoomShapeAsset.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FDungeonRoomShapeVariantsTest, "DungeonRPG.RoomShape.VariantCounts",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::ProductFilter)
+
+bool FDungeonRoomShapeVariantsTest::RunTest(const FString& Parameters)
+{
+	UDungeonRoomShapeAsset* Shape = NewObject<UDungeonRoomShapeAsset>(GetTransientPackage());
+	auto CountVariants = [Shape](const TArray<FCoord>& Tiles, const bool bAllowRotations, const bool bAllowReflections)
+	{
+		Shape->Tiles = Tiles;
+		Shape->bAllowRotations = bAllowRotations;
+		Shape->bAllowReflections = bAllowReflections;
+		Shape->RebuildVariants();
+		return Shape->Variants.Num();
+	};
+
+	const TArray<FCoord> LTetromino = { FCoord(0,0), FCoord(0,1), FCoord(0,2), FCoord(1,0) };
+	TestEqual(TEXT("L tetromino, rotations and reflections"), CountVariants(LTetromino, true, true), 8);
+	TestEqual(TEXT("L tetromino, rotations only"), CountVariants(LTetromino, true, false), 4);
+	TestEqual(TEXT("L tetromino, fixed"), CountVariants(LTetromino, false, false), 1);
+
+	// Symmetric shapes have orientations that are identical, which should only be kept once
+	const TArray<FCoord> TTetromino = { FCoord(-1,0), FCoord(0,0), FCoord(1,0), FCoord(0,1) };
+	TestEqual(TEXT("T tetromino"), CountVariants(TTetromino, true, true), 4);
+	const TArray<FCoord> Square = { FCoord(0,0), FCoord(1,0), FCoord(0,1), FCoord(1,1) };
+	TestEqual(TEXT("2x2 square"), CountVariants(Square, true, true), 1);
+
+	AddExpectedError(TEXT("aren't connected"), EAutomationExpectedErrorFlags::Contains, 1);
+	const TArray<FCoord> Disconnected = { FCoord(0,0), FCoord(2,0) };
+	TestEqual(TEXT("Disconnected tiles"), CountVariants(Disconnected, true, true), 0);
+	return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FDungeonOccupancyGridTest, "DungeonRPG.RoomShape.OccupancyGrid",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::ProductFilter)
+
+bool FDungeonOccupancyGridTest::RunTest(const FString& Parameters)
+{
+	FDungeonRoomVariant Square;
+	TestTrue(TEXT("2x2 square builds"), FDungeonRoomVariant::Build({ FCoord(0,0), FCoord(1,0), FCoord(0,1), FCoord(1,1) }, Square));
+
+	// Tiles far apart on both sides of 0, so the grid has to grow and rows span several words
+	FDungeonOccupancyGrid Grid;
+	Grid.Add(FCoord(-70, 5));
+	Grid.Add(FCoord(65, -3));
+	Grid.Add(FCoord(63, -3));
+	TestTrue(TEXT("Contains a negative tile"), Grid.Contains(FCoord(-70, 5)));
+	TestTrue(TEXT("Contains a tile past the first word"), Grid.Contains(FCoord(65, -3)));
+	TestFalse(TEXT("Doesn't contain a neighbour"), Grid.Contains(FCoord(64, -3)));
+
+	TestTrue(TEXT("Overlaps a used tile"), Grid.Overlaps(Square, FCoord(-71, 4)));
+	TestTrue(TEXT("Overlaps across a word boundary"), Grid.Overlaps(Square, FCoord(63, -4)));
+	TestFalse(TEXT("Fits in a gap"), Grid.Overlaps(Square, FCoord(0, 0)));
+
+	Grid.Remove(FCoord(65, -3));
+	Grid.Remove(FCoord(63, -3));
+	TestFalse(TEXT("Fits once the tiles are removed"), Grid.Overlaps(Square, FCoord(63, -4)));
+	return true;
+}
+
+#endif